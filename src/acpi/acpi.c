@@ -0,0 +1,232 @@
+#include "acpi.h"
+#include "../memory/memory.h"
+#include "../status.h"
+
+
+// https://wiki.osdev.org/RSDP
+struct acpi_rsdp {
+    char     signature[8];  // "RSD PTR "
+    uint8_t  checksum;
+    char     oem_id[6];
+    uint8_t  revision;
+    uint32_t rsdt_address;
+} __attribute__((packed));
+
+
+// https://wiki.osdev.org/RSDT
+struct acpi_sdt_header {
+    char     signature[4];
+    uint32_t length;
+    uint8_t  revision;
+    uint8_t  checksum;
+    char     oem_id[6];
+    char     oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+
+// https://wiki.osdev.org/MADT
+struct acpi_madt {
+    struct acpi_sdt_header header;
+    uint32_t               lapic_address;
+    uint32_t               flags;
+} __attribute__((packed));
+
+struct acpi_madt_entry {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+#define ACPI_MADT_LAPIC 0
+#define ACPI_MADT_IOAPIC 1
+#define ACPI_MADT_INTERRUPT_OVERRIDE 2
+
+struct acpi_madt_lapic {
+    struct acpi_madt_entry entry;
+    uint8_t                processor_id;
+    uint8_t                apic_id;
+    uint32_t               flags;  // bit 0: enabled
+} __attribute__((packed));
+
+struct acpi_madt_ioapic {
+    struct acpi_madt_entry entry;
+    uint8_t                id;
+    uint8_t                reserved;
+    uint32_t               address;
+    uint32_t               gsi_base;
+} __attribute__((packed));
+
+struct acpi_madt_interrupt_override {
+    struct acpi_madt_entry entry;
+    uint8_t                bus;
+    uint8_t                source;  // ISA IRQ
+    uint32_t               gsi;
+    uint16_t               flags;
+} __attribute__((packed));
+
+
+#define ACPI_EBDA_SEGMENT_POINTER 0x40E
+#define ACPI_BIOS_AREA_START 0xE0000
+#define ACPI_BIOS_AREA_END 0x100000
+
+
+static struct acpi_madt_info madt_info;
+
+
+static uint8_t acpi_checksum(void* ptr, uint32_t length) {
+    uint8_t  sum   = 0;
+    uint8_t* bytes = ptr;
+    for (uint32_t i = 0; i < length; ++i) {
+        sum += bytes[i];
+    }
+    return sum;
+}
+
+
+static struct acpi_rsdp* acpi_scan_rsdp(uint32_t start, uint32_t end) {
+    // The RSDP is on a 16 bytes boundary.
+    for (uint32_t addr = start; addr + sizeof(struct acpi_rsdp) <= end;
+         addr += 16) {
+        struct acpi_rsdp* rsdp = (struct acpi_rsdp*)addr;
+        if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0
+            && acpi_checksum(rsdp, sizeof(struct acpi_rsdp)) == 0) {
+            return rsdp;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief The RSDP is either in the first KiB of the EBDA or in the BIOS
+ *        area below 1MiB.
+ *
+ * @return struct acpi_rsdp*
+ */
+static struct acpi_rsdp* acpi_find_rsdp() {
+    uint32_t ebda = (uint32_t)(*(uint16_t*)ACPI_EBDA_SEGMENT_POINTER) << 4;
+
+    struct acpi_rsdp* rsdp = 0;
+    if (ebda) {
+        rsdp = acpi_scan_rsdp(ebda, ebda + 1024);
+    }
+    if (!rsdp) {
+        rsdp = acpi_scan_rsdp(ACPI_BIOS_AREA_START, ACPI_BIOS_AREA_END);
+    }
+
+    return rsdp;
+}
+
+
+static struct acpi_sdt_header* acpi_find_table(struct acpi_sdt_header* rsdt,
+                                               const char* signature) {
+    int total = (rsdt->length - sizeof(struct acpi_sdt_header)) / 4;
+    uint32_t* entries = (uint32_t*)(rsdt + 1);
+
+    for (int i = 0; i < total; ++i) {
+        struct acpi_sdt_header* header = (struct acpi_sdt_header*)entries[i];
+        if (memcmp(header->signature, (void*)signature, 4) == 0
+            && acpi_checksum(header, header->length) == 0) {
+            return header;
+        }
+    }
+
+    return 0;
+}
+
+
+static void acpi_parse_madt(struct acpi_madt* madt) {
+    madt_info.lapic_address = madt->lapic_address;
+    for (int i = 0; i < ACPI_TOTAL_ISA_IRQS; ++i) {
+        madt_info.isa_irq_gsi[i] = i;
+    }
+
+    uint8_t* ptr = (uint8_t*)(madt + 1);
+    uint8_t* end = (uint8_t*)madt + madt->header.length;
+    while (ptr < end) {
+        struct acpi_madt_entry* entry = (struct acpi_madt_entry*)ptr;
+        if (entry->length == 0) {
+            break;
+        }
+
+        switch (entry->type) {
+        case ACPI_MADT_LAPIC: {
+            struct acpi_madt_lapic* lapic = (struct acpi_madt_lapic*)entry;
+            if ((lapic->flags & 0x01) && madt_info.total_cpus < RAOS_MAX_CPUS) {
+                madt_info.cpu_apic_ids[madt_info.total_cpus++] = lapic->apic_id;
+            }
+            break;
+        }
+
+        case ACPI_MADT_IOAPIC: {
+            struct acpi_madt_ioapic* ioapic = (struct acpi_madt_ioapic*)entry;
+            if (madt_info.total_ioapics < ACPI_MAX_IOAPICS) {
+                struct acpi_ioapic* info =
+                    &madt_info.ioapics[madt_info.total_ioapics++];
+                info->id       = ioapic->id;
+                info->address  = ioapic->address;
+                info->gsi_base = ioapic->gsi_base;
+            }
+            break;
+        }
+
+        case ACPI_MADT_INTERRUPT_OVERRIDE: {
+            struct acpi_madt_interrupt_override* override =
+                (struct acpi_madt_interrupt_override*)entry;
+            if (override->source < ACPI_TOTAL_ISA_IRQS) {
+                madt_info.isa_irq_gsi[override->source]   = override->gsi;
+                madt_info.isa_irq_flags[override->source] = override->flags;
+            }
+            break;
+        }
+
+        default:
+            break;
+        }
+
+        ptr += entry->length;
+    }
+}
+
+
+/**
+ * @brief Find the MADT through RSDP and RSDT, QEMU (SeaBIOS) provides them.
+ *        Physical memory is identity mapped, tables are read in place.
+ *
+ * @return int 0 if the MADT was found.
+ */
+int acpi_init() {
+    memset(&madt_info, 0, sizeof(madt_info));
+
+    struct acpi_rsdp* rsdp = acpi_find_rsdp();
+    if (!rsdp) {
+        return -EIO;
+    }
+
+    struct acpi_sdt_header* rsdt =
+        (struct acpi_sdt_header*)rsdp->rsdt_address;
+    if (memcmp(rsdt->signature, "RSDT", 4) != 0
+        || acpi_checksum(rsdt, rsdt->length) != 0) {
+        return -EIO;
+    }
+
+    struct acpi_madt* madt = (struct acpi_madt*)acpi_find_table(rsdt, "APIC");
+    if (!madt) {
+        return -EIO;
+    }
+
+    acpi_parse_madt(madt);
+    if (!madt_info.total_ioapics || !madt_info.total_cpus) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+
+struct acpi_madt_info* acpi_madt() {
+    return &madt_info;
+}
@@ -0,0 +1,41 @@
+#ifndef _ACPI_H
+#define _ACPI_H
+
+#include <stdint.h>
+
+#include "../config.h"
+
+#define ACPI_MAX_IOAPICS 4
+#define ACPI_TOTAL_ISA_IRQS 16
+
+// Interrupt source override flags (MPS INTI flags).
+#define ACPI_IRQ_POLARITY_MASK 0x03
+#define ACPI_IRQ_POLARITY_LOW 0x03
+#define ACPI_IRQ_TRIGGER_MASK 0x0C
+#define ACPI_IRQ_TRIGGER_LEVEL 0x0C
+
+struct acpi_ioapic {
+    uint8_t  id;
+    uint32_t address;
+    uint32_t gsi_base;  // first global system interrupt it serves
+};
+
+// What the kernel needs from the MADT ("APIC" table).
+struct acpi_madt_info {
+    uint32_t lapic_address;
+
+    int     total_cpus;
+    uint8_t cpu_apic_ids[RAOS_MAX_CPUS];
+
+    int                total_ioapics;
+    struct acpi_ioapic ioapics[ACPI_MAX_IOAPICS];
+
+    // ISA IRQ to global system interrupt, identity unless overridden.
+    uint32_t isa_irq_gsi[ACPI_TOTAL_ISA_IRQS];
+    uint16_t isa_irq_flags[ACPI_TOTAL_ISA_IRQS];
+};
+
+int                    acpi_init();
+struct acpi_madt_info* acpi_madt();
+
+#endif
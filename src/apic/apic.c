@@ -0,0 +1,315 @@
+#include "apic.h"
+#include "../acpi/acpi.h"
+#include "../cpu/cpu.h"
+#include "../memory/paging/paging.h"
+#include "../status.h"
+#include "../timer/pit.h"
+
+
+// Local APIC registers, offsets from the MMIO base.
+#define LAPIC_REG_ID 0x20
+#define LAPIC_REG_TPR 0x80
+#define LAPIC_REG_EOI 0xB0
+#define LAPIC_REG_SPURIOUS 0xF0
+#define LAPIC_REG_ICR_LOW 0x300
+#define LAPIC_REG_ICR_HIGH 0x310
+#define LAPIC_REG_LVT_TIMER 0x320
+#define LAPIC_REG_LVT_LINT0 0x350
+#define LAPIC_REG_LVT_LINT1 0x360
+#define LAPIC_REG_LVT_ERROR 0x370
+#define LAPIC_REG_TIMER_INITIAL 0x380
+#define LAPIC_REG_TIMER_CURRENT 0x390
+#define LAPIC_REG_TIMER_DIVIDE 0x3E0
+
+#define LAPIC_SOFTWARE_ENABLE 0x100
+#define LAPIC_LVT_MASKED 0x10000
+#define LAPIC_TIMER_PERIODIC 0x20000
+#define LAPIC_TIMER_DIVIDE_BY_16 0x03
+
+#define LAPIC_ICR_INIT 0x500
+#define LAPIC_ICR_STARTUP 0x600
+#define LAPIC_ICR_DELIVERY_PENDING 0x1000
+#define LAPIC_ICR_LEVEL_ASSERT 0x4000
+
+#define IA32_APIC_BASE_MSR 0x1B
+#define IA32_APIC_BASE_ENABLE 0x800
+
+#define CPUID_FEATURE_APIC (1 << 9)
+
+// IOAPIC registers, accessed through the select/window pair.
+#define IOAPIC_REG_SELECT 0x00
+#define IOAPIC_REG_WINDOW 0x10
+#define IOAPIC_REG_VERSION 0x01
+#define IOAPIC_REG_REDIRECTION 0x10
+
+#define IOAPIC_POLARITY_LOW (1 << 13)
+#define IOAPIC_TRIGGER_LEVEL (1 << 15)
+#define IOAPIC_MASKED (1 << 16)
+
+#define APIC_CALIBRATE_MS 10
+
+
+static volatile uint8_t* lapic_base = 0;
+static bool              apic_enabled = false;
+
+// Local APIC timer ticks per millisecond, divided by 16.
+static uint32_t apic_timer_ticks_per_ms = 0;
+
+
+static uint32_t lapic_read(uint32_t reg) {
+    return *(volatile uint32_t*)(lapic_base + reg);
+}
+
+
+static void lapic_write(uint32_t reg, uint32_t val) {
+    *(volatile uint32_t*)(lapic_base + reg) = val;
+}
+
+
+static uint32_t ioapic_read(uint32_t address, uint32_t reg) {
+    volatile uint32_t* ioapic = (volatile uint32_t*)address;
+    ioapic[IOAPIC_REG_SELECT / 4] = reg;
+    return ioapic[IOAPIC_REG_WINDOW / 4];
+}
+
+
+static void ioapic_write(uint32_t address, uint32_t reg, uint32_t val) {
+    volatile uint32_t* ioapic = (volatile uint32_t*)address;
+    ioapic[IOAPIC_REG_SELECT / 4] = reg;
+    ioapic[IOAPIC_REG_WINDOW / 4] = val;
+}
+
+
+bool apic_is_enabled() {
+    return apic_enabled;
+}
+
+
+uint8_t lapic_id() {
+    if (!apic_enabled) {
+        return 0;
+    }
+
+    return lapic_read(LAPIC_REG_ID) >> 24;
+}
+
+
+void lapic_send_eoi() {
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+
+static void lapic_send_ipi(uint8_t apic_id, uint32_t command) {
+    lapic_write(LAPIC_REG_ICR_HIGH, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, command);
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_DELIVERY_PENDING) {}
+}
+
+
+void lapic_send_init(uint8_t apic_id) {
+    lapic_send_ipi(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_LEVEL_ASSERT);
+}
+
+
+// The processor starts in real mode at page * 4096.
+void lapic_send_startup(uint8_t apic_id, uint8_t page) {
+    lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP | page);
+}
+
+
+// Fixed delivery of vector to one CPU.
+void lapic_send_fixed(uint8_t apic_id, int vector) {
+    lapic_send_ipi(apic_id, vector & 0xFF);
+}
+
+
+/**
+ * @brief Find the IOAPIC serving the global system interrupt.
+ *
+ * @param gsi
+ * @param pin_out input pin of the IOAPIC.
+ * @return struct acpi_ioapic*
+ */
+static struct acpi_ioapic* ioapic_for_gsi(uint32_t gsi, int* pin_out) {
+    struct acpi_madt_info* madt = acpi_madt();
+    for (int i = 0; i < madt->total_ioapics; ++i) {
+        struct acpi_ioapic* ioapic = &madt->ioapics[i];
+        uint32_t total_pins =
+            ((ioapic_read(ioapic->address, IOAPIC_REG_VERSION) >> 16) & 0xff)
+            + 1;
+        if (gsi >= ioapic->gsi_base && gsi < ioapic->gsi_base + total_pins) {
+            *pin_out = gsi - ioapic->gsi_base;
+            return ioapic;
+        }
+    }
+
+    return 0;
+}
+
+
+static void ioapic_set_redirection(int irq, uint32_t low) {
+    struct acpi_madt_info* madt = acpi_madt();
+    if (irq < 0 || irq >= ACPI_TOTAL_ISA_IRQS) {
+        return;
+    }
+
+    int                 pin    = 0;
+    struct acpi_ioapic* ioapic = ioapic_for_gsi(madt->isa_irq_gsi[irq], &pin);
+    if (!ioapic) {
+        return;
+    }
+
+    // ISA IRQs are edge/active high unless the MADT overrides them.
+    uint16_t flags = madt->isa_irq_flags[irq];
+    if ((flags & ACPI_IRQ_POLARITY_MASK) == ACPI_IRQ_POLARITY_LOW) {
+        low |= IOAPIC_POLARITY_LOW;
+    }
+    if ((flags & ACPI_IRQ_TRIGGER_MASK) == ACPI_IRQ_TRIGGER_LEVEL) {
+        low |= IOAPIC_TRIGGER_LEVEL;
+    }
+
+    // Physical destination: the bootstrap processor.
+    uint32_t reg = IOAPIC_REG_REDIRECTION + pin * 2;
+    ioapic_write(ioapic->address, reg + 1, (uint32_t)lapic_id() << 24);
+    ioapic_write(ioapic->address, reg, low);
+}
+
+
+/**
+ * @brief Deliver the ISA irq as vector, honouring the MADT overrides.
+ *
+ * @param irq
+ * @param vector
+ */
+void ioapic_route_irq(int irq, int vector) {
+    ioapic_set_redirection(irq, vector & 0xff);
+}
+
+
+void ioapic_mask_irq(int irq) {
+    ioapic_set_redirection(irq, IOAPIC_MASKED);
+}
+
+
+/**
+ * @brief Count local APIC timer ticks during a PIT one-shot.
+ *
+ */
+static void apic_timer_calibrate() {
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_BY_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+
+    pit_oneshot_start(APIC_CALIBRATE_MS);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, 0xFFFFFFFF);
+    while (!pit_oneshot_expired()) {}
+
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_REG_TIMER_CURRENT);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, 0);
+
+    apic_timer_ticks_per_ms = elapsed / APIC_CALIBRATE_MS;
+}
+
+
+/**
+ * @brief Periodic local APIC timer interrupt hz times per second.
+ *
+ * @param vector
+ * @param hz
+ */
+void apic_timer_start(int vector, int hz) {
+    if (!apic_timer_ticks_per_ms) {
+        apic_timer_calibrate();
+    }
+
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_BY_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, vector | LAPIC_TIMER_PERIODIC);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, apic_timer_ticks_per_ms * 1000 / hz);
+}
+
+
+/**
+ * @brief One local APIC timer interrupt ms milliseconds from now, replaces
+ *        the periodic mode until apic_timer_start() again.
+ *
+ * @param vector
+ * @param ms
+ */
+void apic_timer_oneshot(int vector, uint32_t ms) {
+    if (ms > 0xFFFFFFFF / apic_timer_ticks_per_ms) {
+        ms = 0xFFFFFFFF / apic_timer_ticks_per_ms;
+    }
+
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_BY_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, vector);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, apic_timer_ticks_per_ms * ms);
+}
+
+
+// Milliseconds the current count went down since it was last loaded.
+uint32_t apic_timer_elapsed_ms() {
+    uint32_t initial = lapic_read(LAPIC_REG_TIMER_INITIAL);
+    uint32_t current = lapic_read(LAPIC_REG_TIMER_CURRENT);
+    return (initial - current) / apic_timer_ticks_per_ms;
+}
+
+
+static void lapic_enable() {
+    uint64_t base = cpu_read_msr(IA32_APIC_BASE_MSR);
+    cpu_write_msr(IA32_APIC_BASE_MSR, base | IA32_APIC_BASE_ENABLE);
+
+    // Accept every priority, mask the legacy lines and errors.
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_LVT_LINT0, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_LVT_LINT1, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_LVT_ERROR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_SPURIOUS,
+                LAPIC_SOFTWARE_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+
+// Local APIC of an application processor, the IOAPICs are already set up.
+void apic_ap_init() {
+    lapic_enable();
+}
+
+
+/**
+ * @brief Enable the local APIC and mask every IOAPIC input. Registers are
+ *        MMIO, mapped uncached into directory.
+ *
+ * @param directory kernel paging chunk.
+ * @return int 0 when the APIC is usable, otherwise keep the 8259 PIC.
+ */
+int apic_init(struct paging_4gb_chunk* directory) {
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_FEATURE_APIC)) {
+        return -EIO;
+    }
+
+    int res = acpi_init();
+    if (res < 0) {
+        return res;
+    }
+
+    struct acpi_madt_info* madt = acpi_madt();
+    int flags = PAGING_IS_PRESENT | PAGING_IS_WRITABLE | PAGING_CACHE_DISABLED
+                | PAGING_WRITE_THROUGH;
+    paging_map(directory, (void*)madt->lapic_address,
+               (void*)madt->lapic_address, flags);
+    for (int i = 0; i < madt->total_ioapics; ++i) {
+        uint32_t address = madt->ioapics[i].address;
+        paging_map(directory, paging_align_to_lower_page((void*)address),
+                   paging_align_to_lower_page((void*)address), flags);
+    }
+
+    lapic_base = (volatile uint8_t*)madt->lapic_address;
+    lapic_enable();
+    apic_enabled = true;
+
+    for (int irq = 0; irq < ACPI_TOTAL_ISA_IRQS; ++irq) {
+        ioapic_mask_irq(irq);
+    }
+
+    return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef _APIC_H
+#define _APIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct paging_4gb_chunk;
+
+// https://wiki.osdev.org/APIC
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+// Inter-processor interrupt waking an idle CPU, see cpu_wakeup().
+#define APIC_WAKEUP_VECTOR 0xF0
+
+// Inter-processor interrupt reloading CR3, see paging_tlb_shootdown().
+#define APIC_TLB_FLUSH_VECTOR 0xF1
+
+int     apic_init(struct paging_4gb_chunk* directory);
+bool    apic_is_enabled();
+uint8_t lapic_id();
+void    lapic_send_eoi();
+void    lapic_send_init(uint8_t apic_id);
+void    lapic_send_startup(uint8_t apic_id, uint8_t page);
+void    lapic_send_fixed(uint8_t apic_id, int vector);
+void    apic_ap_init();
+
+void ioapic_route_irq(int irq, int vector);
+void ioapic_mask_irq(int irq);
+
+void     apic_timer_start(int vector, int hz);
+void     apic_timer_oneshot(int vector, uint32_t ms);
+uint32_t apic_timer_elapsed_ms();
+
+#endif
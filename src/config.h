@@ -1,7 +1,40 @@
 #ifndef _CONFIG_H
 #define _CONFIG_H
 
-#define RAOS_TOTAL_INTERRUPTS 512
+#define RAOS_TOTAL_INTERRUPTS 256  // keep in sync with idt.asm
+
+// Slots of the deferred interrupt work ring, power of 2.
+#define RAOS_DEFERRED_WORK_QUEUE_SIZE 64
+
+// Scheduling tick, from the local APIC timer or the PIT.
+#define RAOS_TIMER_HZ 100
+
+// Longest sleep of an idle CPU with the tick stopped. Idle application
+// processors wake up that often to look for work to steal.
+#define RAOS_TICKLESS_MAX_IDLE_MS 1000
+
+#define RAOS_MAX_CPUS 8
+
+// A CPU with more than one runnable task looks for a busier neighbour to
+// steal from every that many scheduling decisions.
+#define RAOS_SCHED_BALANCE_INTERVAL 8
+
+// Kernel stacks of the application processors.
+#define RAOS_CPU_KERNEL_STACK_SIZE 1024 * 16
+
+// Every task enters the kernel on its own stack (tss.esp0), so it can block
+// in a system command without holding up the other tasks.
+#define RAOS_TASK_KERNEL_STACK_SIZE 1024 * 16
+
+// Benchmark build only: 1 loads the kernel's directory on every interrupt
+// from user land and the task's on the way back, as the kernel did before
+// the task's directory stayed loaded. The switch stats report both.
+#define RAOS_TASK_SWITCH_RELOAD_CR3 0
+
+// Real mode start up code of the application processors, 4KiB aligned and
+// below 1MiB, clear of the heap table at RAOS_HEAP_TABLE_ADDRESS.
+// Keep in sync with smp.asm
+#define RAOS_SMP_TRAMPOLINE_ADDRESS 0x10000
 
 // define in kernel.asm CODE_SEG, DATA_SEG
 #define KERNEL_CODE_SELECTOR 0x08
@@ -18,18 +51,62 @@
 #define RAOS_HEAP_ADDRESS 0x01000000
 #define RAOS_HEAP_TABLE_ADDRESS 0x00007E00
 
+// Per-CPU cache of free single block allocations in front of the kernel heap,
+// refilled from and flushed to the heap RAOS_KHEAP_MAGAZINE_BATCH at a time.
+#define RAOS_KHEAP_MAGAZINE_SIZE 32
+#define RAOS_KHEAP_MAGAZINE_BATCH 16
+
 #define RAOS_SECTOR_SIZE 512
 
+// A disk command not ready within that many milliseconds fails with -EIO.
+#define RAOS_DISK_TIMEOUT_MS 1000
+
+// Sectors kept by the block cache, and its hash buckets (a power of two).
+// Drives on the two ATA channels and their partitions.
+#define RAOS_MAX_DISKS 16
+
+// Disk copied into a RAM disk at boot, -1 for none. The RAM disk is added
+// after the drives and their partitions.
+#define RAOS_RAMDISK_IMAGE -1
+// Sectors of the RAM disk, 0 for the size of the image. Without an image a
+// blank RAM disk of that size is made.
+#define RAOS_RAMDISK_SECTORS 0
+
+#define RAOS_DISK_CACHE_BLOCKS 256
+#define RAOS_DISK_CACHE_HASH_SIZE 64
+
+// Disk requests merged into one command at most, and how long the elevator
+// may pass a request over.
+#define RAOS_DISK_QUEUE_MAX_MERGE 16
+#define RAOS_DISK_QUEUE_DEADLINE_MS 100
+
+// Dirty cached sectors are written back at the latest after that long.
+#define RAOS_DISK_WRITEBACK_MS 5000
+
+// Largest readahead window of a file read sequentially, in bytes.
+#define RAOS_READAHEAD_MAX_BYTES 65536
+
+// Names of contended locks spin_lock_print_stats() keeps apart.
+#define RAOS_MAX_LOCK_STATS 64
+
 #define RAOS_MAX_FILESYSTEMS 16
 #define RAOS_MAX_FILE_DESCRIPTORS 512
 
 #define RAOS_MAX_PATH 128
 
-#define RAOS_TOTAL_GDT_SEGMENTS 6
+// null, kernel code/data, user code/data, then one TSS per CPU.
+#define RAOS_GDT_TSS_INDEX 5
+#define RAOS_TOTAL_GDT_SEGMENTS (RAOS_GDT_TSS_INDEX + RAOS_MAX_CPUS)
 
 
 #define RAOS_MAX_PROCESSES 12
 
+// Threads per process, the main thread included.
+#define RAOS_MAX_PROCESS_THREADS 8
+
+// Futex wait queue buckets, a power of two.
+#define RAOS_FUTEX_HASH_SIZE 64
+
 #define RAOS_MAX_PROGRAM_ALLOCATIONS 1024
 
 #define RAOS_USER_PROGRAM_STACK_SIZE 1024 * 16
@@ -0,0 +1,136 @@
+#ifndef _CPU_H
+#define _CPU_H
+
+#include <stdint.h>
+
+// Small single instruction helpers, inlined so hot paths (interrupt entry,
+// locks) do not pay a call for them.
+
+// Sleep until the next interrupt.
+static inline void cpu_halt() {
+    __asm__ volatile("hlt");
+}
+
+
+// Enable interrupts and sleep. sti takes effect after the next instruction,
+// so an interrupt pending since the caller looked for work still wakes hlt.
+static inline void cpu_sti_halt() {
+    __asm__ volatile("sti; hlt");
+}
+
+
+// Spin-wait hint.
+static inline void cpu_pause() {
+    __asm__ volatile("pause" ::: "memory");
+}
+
+
+#define CPU_EFLAGS_IF 0x200
+
+// Disable interrupts, returning the previous eflags for cpu_irq_restore().
+static inline uint32_t cpu_irq_save() {
+    uint32_t flags;
+    __asm__ volatile("pushf\n\tpop %0\n\tcli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+
+static inline void cpu_irq_restore(uint32_t flags) {
+    if (flags & CPU_EFLAGS_IF) {
+        __asm__ volatile("sti" ::: "memory");
+    }
+}
+
+
+#define CPU_CR0_MP (1 << 1)  // monitor coprocessor, wait/fwait honour TS
+#define CPU_CR0_EM (1 << 2)  // no x87, every FPU instruction traps
+#define CPU_CR0_TS (1 << 3)  // task switched, the next FPU instruction traps
+#define CPU_CR0_NE (1 << 5)  // native x87 error reporting
+
+#define CPU_CR4_OSFXSR     (1 << 9)   // fxsave/fxrstor and SSE
+#define CPU_CR4_OSXMMEXCPT (1 << 10)  // unmasked SSE exceptions raise #XM
+
+static inline uint32_t cpu_read_cr0() {
+    uint32_t val;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(val));
+    return val;
+}
+
+
+static inline void cpu_write_cr0(uint32_t val) {
+    __asm__ volatile("mov %0, %%cr0" ::"r"(val) : "memory");
+}
+
+
+static inline uint32_t cpu_read_cr4() {
+    uint32_t val;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(val));
+    return val;
+}
+
+
+static inline void cpu_write_cr4(uint32_t val) {
+    __asm__ volatile("mov %0, %%cr4" ::"r"(val) : "memory");
+}
+
+
+// Drop the TLB entry of one page.
+static inline void cpu_invlpg(void* addr) {
+    __asm__ volatile("invlpg (%0)" ::"r"(addr) : "memory");
+}
+
+
+// Clear CR0.TS.
+static inline void cpu_clts() {
+    __asm__ volatile("clts");
+}
+
+
+static inline uint32_t cpu_read_cr2() {
+    uint32_t val;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(val));
+    return val;
+}
+
+
+static inline void cpu_cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx,
+                             uint32_t* ecx, uint32_t* edx) {
+    __asm__ volatile("cpuid"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(0));
+}
+
+
+static inline uint64_t cpu_read_msr(uint32_t msr) {
+    uint32_t low, high;
+    __asm__ volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+
+static inline void cpu_write_msr(uint32_t msr, uint64_t val) {
+    __asm__ volatile("wrmsr"
+                     :
+                     : "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+
+// Time stamp counter, cycles since reset.
+static inline uint64_t cpu_rdtsc() {
+    uint32_t low, high;
+    __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+
+// 64 by 32 bits division without libgcc, the quotient must fit in 32 bits.
+static inline uint32_t cpu_div_u64_u32(uint64_t dividend, uint32_t divisor) {
+    uint32_t quotient, remainder;
+    __asm__("divl %4"
+            : "=a"(quotient), "=d"(remainder)
+            : "a"((uint32_t)dividend), "d"((uint32_t)(dividend >> 32)),
+              "rm"(divisor));
+    return quotient;
+}
+
+#endif
@@ -0,0 +1,168 @@
+#include "fpu.h"
+#include "../idt/idt.h"
+#include "../kernel.h"
+#include "../smp/smp.h"
+#include "../task/task.h"
+#include "cpu.h"
+
+#define CPUID_FEATURE_FXSR (1 << 24)
+#define CPUID_FEATURE_SSE  (1 << 25)
+
+#define FPU_EXCEPTION_NOT_AVAILABLE 7
+
+#define FPU_MXCSR_DEFAULT 0x1F80  // all SSE exceptions masked
+
+static bool fpu_enabled = false;
+
+// fninit state, loaded on the first FPU instruction of a task.
+static struct fpu_state fpu_initial_state;
+
+
+static inline void fpu_fxsave(struct fpu_state* state) {
+    __asm__ volatile("fxsave %0" : "=m"(*state));
+}
+
+
+static inline void fpu_fxrstor(struct fpu_state* state) {
+    __asm__ volatile("fxrstor %0" ::"m"(*state));
+}
+
+
+bool fpu_is_enabled() {
+    return fpu_enabled;
+}
+
+
+/**
+ * @brief #NM, the current task used the FPU with CR0.TS set. Save the state
+ *        of the previous owner on this CPU and load the current task's,
+ *        then return to the faulting instruction.
+ *
+ * @param frame
+ */
+static void fpu_not_available_handler(struct interrupt_frame* frame) {
+    struct cpu*  cpu  = cpu_current();
+    struct task* task = task_current();
+    if (!task) {
+        panic("FPU used by the kernel\n");
+    }
+
+    cpu_clts();
+    if (cpu->fpu_owner == task) {
+        return;
+    }
+
+    if (cpu->fpu_owner) {
+        fpu_fxsave(&cpu->fpu_owner->fpu);
+        cpu->fpu_owner->fpu_cpu = -1;
+    }
+
+    fpu_fxrstor(task->fpu_used ? &task->fpu : &fpu_initial_state);
+    task->fpu_used  = true;
+    task->fpu_cpu   = cpu->id;
+    cpu->fpu_owner  = task;
+}
+
+
+/**
+ * @brief Enable x87 and SSE on this CPU with CR0.TS set, so the first FPU
+ *        instruction traps into fpu_not_available_handler().
+ *
+ */
+static void fpu_cpu_enable() {
+    uint32_t cr0 = cpu_read_cr0();
+    cr0 &= ~CPU_CR0_EM;
+    cr0 |= CPU_CR0_MP | CPU_CR0_NE;
+    cpu_write_cr0(cr0);
+    cpu_write_cr4(cpu_read_cr4() | CPU_CR4_OSFXSR | CPU_CR4_OSXMMEXCPT);
+
+    uint32_t mxcsr = FPU_MXCSR_DEFAULT;
+    __asm__ volatile("fninit");
+    __asm__ volatile("ldmxcsr %0" ::"m"(mxcsr));
+}
+
+
+/**
+ * @brief Lazy FPU/SSE switching, needs fxsave and SSE. Without them CR0.EM
+ *        stays set and an FPU instruction is an exception as before.
+ *
+ */
+void fpu_init() {
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_FEATURE_FXSR) || !(edx & CPUID_FEATURE_SSE)) {
+        return;
+    }
+
+    fpu_cpu_enable();
+    fpu_fxsave(&fpu_initial_state);
+    cpu_write_cr0(cpu_read_cr0() | CPU_CR0_TS);
+
+    idt_register_interrupt_callback(FPU_EXCEPTION_NOT_AVAILABLE,
+                                    fpu_not_available_handler);
+    fpu_enabled = true;
+}
+
+
+void fpu_ap_init() {
+    if (!fpu_enabled) {
+        return;
+    }
+
+    fpu_cpu_enable();
+    cpu_write_cr0(cpu_read_cr0() | CPU_CR0_TS);
+}
+
+
+/**
+ * @brief Called when next is about to run on this CPU. Nothing is saved or
+ *        loaded here: TS is clear only while the registers hold next's
+ *        state, otherwise its first FPU instruction traps.
+ *
+ * @param next
+ */
+void fpu_switch(struct task* next) {
+    if (!fpu_enabled) {
+        return;
+    }
+
+    if (cpu_current()->fpu_owner == next) {
+        cpu_clts();
+        return;
+    }
+
+    cpu_write_cr0(cpu_read_cr0() | CPU_CR0_TS);
+}
+
+
+// A freed task must not be saved into by a later #NM.
+void fpu_task_free(struct task* task) {
+    int cpu_id = task->fpu_cpu;
+    if (cpu_id < 0) {
+        return;
+    }
+
+    struct cpu* cpu = cpu_get(cpu_id);
+    __sync_bool_compare_and_swap(&cpu->fpu_owner, task, 0);
+    task->fpu_cpu = -1;
+}
+
+
+/**
+ * @brief Save the FPU state of a task held by this CPU into the task, so it
+ *        can run on another CPU. Interrupts must be off.
+ *
+ * @param task
+ */
+void fpu_release(struct task* task) {
+    struct cpu* cpu = cpu_current();
+    if (!fpu_enabled || cpu->fpu_owner != task) {
+        return;
+    }
+
+    cpu_clts();
+    fpu_fxsave(&task->fpu);
+    cpu_write_cr0(cpu_read_cr0() | CPU_CR0_TS);
+    cpu->fpu_owner = 0;
+    task->fpu_cpu  = -1;
+}
@@ -0,0 +1,22 @@
+#ifndef _FPU_H
+#define _FPU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct task;
+
+// x87/MMX/SSE registers as written by fxsave, 16 byte aligned.
+struct fpu_state {
+    uint8_t data[512];
+} __attribute__((aligned(16)));
+
+void fpu_init();
+void fpu_ap_init();
+bool fpu_is_enabled();
+
+void fpu_switch(struct task* next);
+void fpu_task_free(struct task* task);
+void fpu_release(struct task* task);
+
+#endif
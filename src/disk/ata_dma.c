@@ -0,0 +1,272 @@
+#include "ata_dma.h"
+#include "../config.h"
+#include "../idt/idt.h"
+#include "../idt/irq.h"
+#include "../io/io.h"
+#include "../lock/spinlock.h"
+#include "../memory/heap/kheap.h"
+#include "../pci/pci.h"
+#include "../status.h"
+#include "../timer/wheel.h"
+#include "disk.h"
+
+
+// Physical region descriptor, one physically contiguous piece of the buffer
+// that does not cross a 64 KiB boundary.
+struct ata_prd {
+    uint32_t address;
+    uint16_t byte_count;  // 0 stands for 64 KiB
+    uint16_t flags;
+} __attribute__((packed));
+
+#define ATA_PRD_END 0x8000
+
+// The single DMA transfer in flight, the disk queue starts one at a time.
+static struct ata_dma {
+    bool            enabled;
+    unsigned short  base;  // bus master I/O ports
+    struct ata_prd* prdt;
+
+    struct spinlock    lock;  // guards the fields below against the IRQ
+    volatile bool      active;
+    ATA_DMA_COMPLETION done;
+    void*              data;
+    struct timer       timeout;
+    uint32_t           sequence;  // of the transfer, a late timeout is ignored
+} ata_dma = {.lock = SPINLOCK_INIT("ata_dma")};
+
+
+/**
+ * @brief Stop the engine and take the outcome of the transfer.
+ *        ata_dma.lock must be held, the caller runs the completion after
+ *        dropping it.
+ *
+ * @param timed_out fail the transfer whatever the controller says
+ * @param status out
+ * @return true if a transfer was active
+ */
+static bool ata_dma_stop(bool timed_out, int* status) {
+    if (!ata_dma.active) {
+        return false;
+    }
+
+    uint8_t bm_status = insb(ata_dma.base + ATA_BM_STATUS);
+    outb(ata_dma.base + ATA_BM_COMMAND, 0);
+    // Reading the status register acknowledges the device interrupt.
+    uint8_t ata_status = insb(ATA_PRIMARY_COMMAND_STATUS);
+    outb(ata_dma.base + ATA_BM_STATUS,
+         bm_status | ATA_BM_STATUS_ERR | ATA_BM_STATUS_IRQ);
+
+    ata_dma.active = false;
+    timer_cancel(&ata_dma.timeout);
+
+    *status = 0;
+    if (timed_out || (bm_status & ATA_BM_STATUS_ERR)
+        || (ata_status & (ATA_STATUS_ERR | ATA_STATUS_DF))) {
+        *status = -EIO;
+    }
+
+    return true;
+}
+
+
+// Finish the transfer when the controller raised its interrupt.
+static void ata_dma_check(bool acknowledge) {
+    int  status  = 0;
+    bool stopped = false;
+
+    uint32_t flags = spin_lock_irqsave(&ata_dma.lock);
+    if (insb(ata_dma.base + ATA_BM_STATUS) & ATA_BM_STATUS_IRQ) {
+        stopped = ata_dma_stop(false, &status);
+    } else if (acknowledge) {
+        // A PIO command, just acknowledge it.
+        insb(ATA_PRIMARY_COMMAND_STATUS);
+    }
+    ATA_DMA_COMPLETION done = ata_dma.done;
+    void*              data = ata_dma.data;
+    spin_unlock_irqrestore(&ata_dma.lock, flags);
+
+    if (stopped) {
+        done(data, status);
+    }
+}
+
+
+static void ata_dma_irq_handler(struct interrupt_frame* frame) {
+    ata_dma_check(true);
+}
+
+
+/**
+ * @brief Finish a transfer without waiting for IRQ14, for a waiter that
+ *        cannot sleep and may run with interrupts off.
+ *
+ */
+void ata_dma_poll() {
+    if (ata_dma.active) {
+        ata_dma_check(false);
+    }
+}
+
+
+static void ata_dma_timeout(void* data) {
+    int  status  = 0;
+    bool stopped = false;
+
+    uint32_t flags = spin_lock_irqsave(&ata_dma.lock);
+    if ((uint32_t)data == ata_dma.sequence) {
+        stopped = ata_dma_stop(true, &status);
+    }
+    ATA_DMA_COMPLETION done = ata_dma.done;
+    void*              done_data = ata_dma.data;
+    spin_unlock_irqrestore(&ata_dma.lock, flags);
+
+    if (stopped) {
+        done(done_data, status);
+    }
+}
+
+
+/**
+ * @brief Use the bus master IDE controller of the primary channel when PCI
+ *        has one, disk transfers fall back to PIO otherwise.
+ *
+ * https://wiki.osdev.org/ATA/ATAPI_using_DMA
+ *
+ * @return int
+ */
+int ata_dma_init() {
+    struct pci_device ide;
+    int               res = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &ide);
+    if (res < 0) {
+        goto out;
+    }
+
+    // Bit 7 of the programming interface: bus mastering supported.
+    uint32_t bar4 = pci_bar(&ide, 4);
+    if (!(ide.prog_if & 0x80) || !(bar4 & PCI_BAR_IO)) {
+        res = -EIO;
+        goto out;
+    }
+
+    // A heap block is page aligned, so the table never crosses 64 KiB.
+    ata_dma.prdt = kzalloc(sizeof(struct ata_prd) * ATA_DMA_MAX_PRDS);
+    if (!ata_dma.prdt) {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    ata_dma.base = bar4 & 0xFFFC;
+    pci_enable_bus_master(&ide);
+
+    idt_register_interrupt_callback(IRQ_VECTOR_BASE + IRQ_ATA_PRIMARY,
+                                    ata_dma_irq_handler);
+    irq_unmask(IRQ_ATA_PRIMARY);
+    ata_dma.enabled = true;
+
+out:
+    return res;
+}
+
+
+bool ata_dma_enabled() {
+    return ata_dma.enabled;
+}
+
+
+/**
+ * @brief Describe the segments in the PRD table. Kernel memory is identity
+ *        mapped, so their addresses are the physical ones.
+ *
+ * @param segments
+ * @param count
+ * @return int
+ */
+static int ata_dma_build_prdt(struct ata_dma_segment* segments, int count) {
+    int prds = 0;
+    for (int i = 0; i < count; ++i) {
+        uint32_t address = (uint32_t)segments[i].buf;
+        uint32_t bytes   = segments[i].bytes;
+        // The low address bit of a descriptor is reserved.
+        if (address & 1) {
+            return -EINVARG;
+        }
+
+        while (bytes) {
+            if (prds == ATA_DMA_MAX_PRDS) {
+                return -EINVARG;
+            }
+
+            uint32_t length = 0x10000 - (address & 0xFFFF);
+            if (length > bytes) {
+                length = bytes;
+            }
+
+            ata_dma.prdt[prds].address    = address;
+            ata_dma.prdt[prds].byte_count = length & 0xFFFF;
+            ata_dma.prdt[prds].flags      = 0;
+            address += length;
+            bytes -= length;
+            ++prds;
+        }
+    }
+
+    if (!prds) {
+        return -EINVARG;
+    }
+
+    ata_dma.prdt[prds - 1].flags = ATA_PRD_END;
+    return 0;
+}
+
+
+/**
+ * @brief Start transferring sectors of the primary master from or to the
+ *        segments with bus master DMA, done runs when IRQ14 reports the end
+ *        of the transfer. Only one transfer may be in flight.
+ *
+ * @param idisk a drive on the primary channel
+ * @param lba Logical block address
+ * @param total number of blocks, at most DISK_MAX_READ_SECTORS.
+ * @param write true to write the segments to the disk
+ * @param segments memory of the data, total sectors in all.
+ * @param count
+ * @param done
+ * @param data passed to done
+ * @return int 0 when started, done is not called otherwise
+ */
+int ata_dma_start(struct disk* idisk, int lba, int total, bool write,
+                  struct ata_dma_segment* segments, int count,
+                  ATA_DMA_COMPLETION done, void* data) {
+    int res = ata_dma_build_prdt(segments, count);
+    if (res < 0) {
+        return res;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&ata_dma.lock);
+    ata_dma.sequence++;
+    ata_dma.done = done;
+    ata_dma.data = data;
+    timer_setup(&ata_dma.timeout, ata_dma_timeout, (void*)ata_dma.sequence);
+
+    uint8_t direction = write ? 0 : ATA_BM_COMMAND_READ;
+    outl(ata_dma.base + ATA_BM_PRDT, (uint32_t)ata_dma.prdt);
+    outb(ata_dma.base + ATA_BM_COMMAND, direction);
+    outb(ata_dma.base + ATA_BM_STATUS, ATA_BM_STATUS_ERR | ATA_BM_STATUS_IRQ);
+
+    outb(ATA_PRIMARY_IO + ATA_REG_DRIVE,
+         idisk->drive_select | ((lba >> 24) & 0x0F));
+    outb(ATA_PRIMARY_IO + ATA_REG_SECTOR_COUNT, total);
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA_LOW, (unsigned char)(lba & 0xff));
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA_MID, (unsigned char)(lba >> 8));
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA_HIGH, (unsigned char)(lba >> 16));
+
+    ata_dma.active = true;
+    outb(ATA_PRIMARY_COMMAND_STATUS,
+         write ? ATA_COMMAND_WRITE_DMA : ATA_COMMAND_READ_DMA);
+    outb(ata_dma.base + ATA_BM_COMMAND, direction | ATA_BM_COMMAND_START);
+    timer_add(&ata_dma.timeout, RAOS_DISK_TIMEOUT_MS);
+    spin_unlock_irqrestore(&ata_dma.lock, flags);
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef _ATA_DMA_H
+#define _ATA_DMA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../config.h"
+
+struct disk;
+
+// Bus master IDE registers of the primary channel, from the I/O base in BAR4.
+#define ATA_BM_COMMAND 0x00
+#define ATA_BM_STATUS  0x02
+#define ATA_BM_PRDT    0x04
+
+#define ATA_BM_COMMAND_START 0x01
+#define ATA_BM_COMMAND_READ  0x08  // the device writes to memory
+#define ATA_BM_STATUS_ACTIVE 0x01
+#define ATA_BM_STATUS_ERR    0x02
+#define ATA_BM_STATUS_IRQ    0x04
+
+// A segment of up to 128 KiB needs at most 3 descriptors.
+#define ATA_DMA_MAX_PRDS (RAOS_DISK_QUEUE_MAX_MERGE * 3)
+
+// One piece of memory of a transfer, the sectors follow each other on disk.
+struct ata_dma_segment {
+    void*    buf;  // even address
+    uint32_t bytes;
+};
+
+// Called once per started transfer with 0 or -EIO, from the IRQ, a timer
+// or ata_dma_poll(), without any driver lock held.
+typedef void (*ATA_DMA_COMPLETION)(void* data, int status);
+
+int  ata_dma_init();
+bool ata_dma_enabled();
+int  ata_dma_start(struct disk* idisk, int lba, int total, bool write,
+                   struct ata_dma_segment* segments, int count,
+                   ATA_DMA_COMPLETION done, void* data);
+void ata_dma_poll();
+
+#endif
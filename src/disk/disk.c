@@ -1,58 +1,657 @@
 #include "disk.h"
 #include "../config.h"
 #include "../io/io.h"
+#include "../kernel.h"
+#include "../lock/mutex.h"
+#include "../memory/heap/kheap.h"
 #include "../memory/memory.h"
 #include "../status.h"
+#include "../string/string.h"
+#include "../task/task.h"
+#include "../timer/wheel.h"
 
 
+// Drives first, in channel order, then their partitions.
+static struct disk disks[RAOS_MAX_DISKS];
+static int         disk_count;
+
+// Master and slave share the task file of their channel, one queue each.
+static struct disk_queue disk_channel_queues[2];
+
+// Entry of the partition table in the master boot record.
+struct mbr_partition {
+    uint8_t  status;  // 0x80 bootable
+    uint8_t  chs_first[3];
+    uint8_t  type;
+    uint8_t  chs_last[3];
+    uint32_t lba_first;
+    uint32_t sectors;
+} __attribute__((packed));
+
+#define MBR_PARTITION_TABLE 446
+#define MBR_PARTITIONS 4
+
+// A cached sector, on a hash chain and on the LRU list.
+struct disk_cache_block {
+    struct disk*             disk;  // 0 while the block is unused
+    unsigned int             lba;
+    struct disk_cache_block* hash_next;
+    struct disk_cache_block* lru_prev;
+    struct disk_cache_block* lru_next;
+    bool                     dirty;    // newer than the disk
+    bool                     writing;  // data is being written back
+    char                     data[RAOS_SECTOR_SIZE] __attribute__((aligned(4)));
+};
+
+// Sector cache below disk_read_block() and disk_write_block(), shared by all
+// disks. Writes only dirty their blocks, disk_flush() writes them back, at
+// the latest RAOS_DISK_WRITEBACK_MS after the first one. The least recently
+// used clean block is recycled on a miss.
+static struct disk_cache {
+    struct spinlock          lock;
+    struct disk_cache_block* blocks;
+    struct disk_cache_block* hash[RAOS_DISK_CACHE_HASH_SIZE];
+    struct disk_cache_block* lru_head;  // most recently used
+    struct disk_cache_block* lru_tail;
+    uint32_t                 hits;
+    uint32_t                 misses;
+    uint32_t                 dirty;
+    uint32_t                 written;  // blocks written back
+
+    // One write back at a time, it sleeps on the drive.
+    struct mutex flush_lock;
+    struct timer writeback_timer;
+    // Writes back when the timer set due, the timer interrupt can not sleep.
+    struct task* writeback_task;
+    bool         writeback_due;
+} disk_cache = {
+    .lock       = SPINLOCK_INIT("disk_cache"),
+    .flush_lock = MUTEX_INIT("disk_flush"),
+};
+
+_Static_assert((RAOS_DISK_CACHE_HASH_SIZE & (RAOS_DISK_CACHE_HASH_SIZE - 1)) == 0,
+               "RAOS_DISK_CACHE_HASH_SIZE must be a power of two");
+
+
+static void disk_timeout(void* data) {
+    *(volatile bool*)data = true;
+}
+
+
+// Wait for the drive to leave BSY, then for DRQ when want_drq.
+static int disk_wait(struct disk* idisk, volatile bool* timed_out,
+                     bool want_drq) {
+    unsigned short status = idisk->io_base + ATA_REG_COMMAND_STATUS;
+    char           c      = insb(status);
+    while ((c & ATA_STATUS_BSY) || (want_drq && !(c & ATA_STATUS_DRQ))) {
+        if ((c & (ATA_STATUS_ERR | ATA_STATUS_DF)) || *timed_out) {
+            return -EIO;
+        }
+        c = insb(status);
+    }
+
+    return (c & (ATA_STATUS_ERR | ATA_STATUS_DF)) ? -EIO : 0;
+}
+
+
+// Select the drive and send an LBA28 command, same as boot.asm:ata_lba_read.
+static void disk_command(struct disk* idisk, int lba, int total,
+                         unsigned char command) {
+    unsigned short base = idisk->io_base;
+    outb(base + ATA_REG_DRIVE, idisk->drive_select | ((lba >> 24) & 0x0F));
+    outb(base + ATA_REG_SECTOR_COUNT, total);
+    outb(base + ATA_REG_LBA_LOW, (unsigned char)(lba & 0xff));
+    outb(base + ATA_REG_LBA_MID, (unsigned char)(lba >> 8));
+    outb(base + ATA_REG_LBA_HIGH, (unsigned char)(lba >> 16));
+    outb(base + ATA_REG_COMMAND_STATUS, command);
+}
 
-struct disk disk;
 
 /**
- * @brief Read data from master hard disk.
+ * @brief Read data from an ATA drive.
  *
  * https://wiki.osdev.org/ATA_read/write_sectors
  * https://wiki.osdev.org/ATA_PIO_Mode
  *
+ * @param idisk a drive, not a partition
  * @param lba Logical block address
  * @param total number of blocks to read.
  * @param buf memory to save data.
  * @return int
  */
-int disk_read_sector(int lba, int total, void* buf) {
-    // Same as boot.asm:ata_lba_read
-    outb(0x1F6, (lba >> 24) | 0xE0);
-    outb(0x1F2, total);
-    outb(0x1F3, (unsigned char)(lba & 0xff));
-    outb(0x1F4, (unsigned char)(lba >> 8));
-    outb(0x1F5, (unsigned char)(lba >> 16));
-    outb(0x1F7, 0x20);
+int disk_read_sector(struct disk* idisk, int lba, int total, void* buf) {
+    int res = 0;
+
+    // Bound a stalled drive. Expires on the tick, so only while it runs.
+    volatile bool timed_out = false;
+    struct timer  timeout;
+    timer_setup(&timeout, disk_timeout, (void*)&timed_out);
+    timer_add(&timeout, RAOS_DISK_TIMEOUT_MS);
+
+    disk_command(idisk, lba, total, ATA_COMMAND_READ_PIO);
 
     unsigned short* ptr = (unsigned short*)buf;
     for (int b = 0; b < total; ++b) {
-        char c = insb(0x1F7);
         // wait for the buffer to be ready
-        while (!(c & 0x08)) {
-            c = insb(0x1F7);
+        res = disk_wait(idisk, &timed_out, true);
+        if (res < 0) {
+            goto out;
         }
 
         // copy data from hard disk to memory
-        for (int i = 0; i < 256; ++i) {
-            *ptr = insw(0x1F0);
-            ++ptr;
+        insw_block(idisk->io_base + ATA_REG_DATA, ptr, RAOS_SECTOR_SIZE / 2);
+        ptr += RAOS_SECTOR_SIZE / 2;
+    }
+
+out:
+    // Lost the race with an expiring timer, let its callback finish with
+    // our stack before returning.
+    if (!timer_cancel(&timeout)) {
+        while (!timed_out) {}
+    }
+
+    return res;
+}
+
+
+/**
+ * @brief Write data to an ATA drive.
+ *
+ * https://wiki.osdev.org/ATA_PIO_Mode
+ *
+ * @param idisk a drive, not a partition
+ * @param lba Logical block address
+ * @param total number of blocks to write.
+ * @param buf data to write.
+ * @return int
+ */
+int disk_write_sector(struct disk* idisk, int lba, int total, void* buf) {
+    int res = 0;
+
+    volatile bool timed_out = false;
+    struct timer  timeout;
+    timer_setup(&timeout, disk_timeout, (void*)&timed_out);
+    timer_add(&timeout, RAOS_DISK_TIMEOUT_MS);
+
+    disk_command(idisk, lba, total, ATA_COMMAND_WRITE_PIO);
+
+    unsigned short* ptr = (unsigned short*)buf;
+    for (int b = 0; b < total; ++b) {
+        res = disk_wait(idisk, &timed_out, true);
+        if (res < 0) {
+            goto out;
         }
+
+        outsw_block(idisk->io_base + ATA_REG_DATA, ptr, RAOS_SECTOR_SIZE / 2);
+        ptr += RAOS_SECTOR_SIZE / 2;
     }
 
-    return 0;
+    // The last sector is written once BSY drops.
+    res = disk_wait(idisk, &timed_out, false);
+
+out:
+    if (!timer_cancel(&timeout)) {
+        while (!timed_out) {}
+    }
+
+    return res;
+}
+
+
+/**
+ * @brief Make the drive write its own write cache to the media.
+ *
+ * @param idisk a drive, not a partition
+ * @return int
+ */
+int disk_flush_drive(struct disk* idisk) {
+    volatile bool timed_out = false;
+    struct timer  timeout;
+    timer_setup(&timeout, disk_timeout, (void*)&timed_out);
+    timer_add(&timeout, RAOS_DISK_TIMEOUT_MS);
+
+    disk_command(idisk, 0, 0, ATA_COMMAND_FLUSH_CACHE);
+    int res = disk_wait(idisk, &timed_out, false);
+
+    if (!timer_cancel(&timeout)) {
+        while (!timed_out) {}
+    }
+
+    return res;
+}
+
+
+/**
+ * @brief Ask for the size of a drive with IDENTIFY DEVICE.
+ *
+ * https://wiki.osdev.org/ATA_PIO_Mode#IDENTIFY_command
+ *
+ * @param idisk io_base and drive_select set
+ * @return int 0 when an ATA drive answered, sectors filled in
+ */
+static int disk_identify(struct disk* idisk) {
+    unsigned short base = idisk->io_base;
+    // Nothing pulls the lines of a channel without drives up.
+    if ((unsigned char)insb(base + ATA_REG_COMMAND_STATUS) == 0xFF) {
+        return -EIO;
+    }
+
+    int           res       = 0;
+    volatile bool timed_out = false;
+    struct timer  timeout;
+    timer_setup(&timeout, disk_timeout, (void*)&timed_out);
+    timer_add(&timeout, RAOS_DISK_TIMEOUT_MS);
+
+    outb(base + ATA_REG_DRIVE, idisk->drive_select);
+    // The selected drive needs 400ns to drive the status register.
+    for (int i = 0; i < 4; ++i) {
+        insb(base + ATA_REG_COMMAND_STATUS);
+    }
+
+    outb(base + ATA_REG_SECTOR_COUNT, 0);
+    outb(base + ATA_REG_LBA_LOW, 0);
+    outb(base + ATA_REG_LBA_MID, 0);
+    outb(base + ATA_REG_LBA_HIGH, 0);
+    outb(base + ATA_REG_COMMAND_STATUS, ATA_COMMAND_IDENTIFY);
+    if (insb(base + ATA_REG_COMMAND_STATUS) == 0) {
+        res = -EIO;
+        goto out;
+    }
+
+    res = disk_wait(idisk, &timed_out, false);
+    if (res < 0) {
+        goto out;
+    }
+
+    // ATAPI and SATA devices leave their signature here.
+    if (insb(base + ATA_REG_LBA_MID) || insb(base + ATA_REG_LBA_HIGH)) {
+        res = -EIO;
+        goto out;
+    }
+
+    res = disk_wait(idisk, &timed_out, true);
+    if (res < 0) {
+        goto out;
+    }
+
+    uint16_t identify[RAOS_SECTOR_SIZE / 2];
+    insw_block(base + ATA_REG_DATA, identify, RAOS_SECTOR_SIZE / 2);
+    // Words 60 and 61: sectors addressable with LBA28.
+    idisk->sectors = identify[60] | ((uint32_t)identify[61] << 16);
+    if (!idisk->sectors) {
+        res = -EIO;
+    }
+
+out:
+    if (!timer_cancel(&timeout)) {
+        while (!timed_out) {}
+    }
+
+    return res;
+}
+
+
+static struct disk_cache_block** disk_cache_bucket(struct disk*  idisk,
+                                                   unsigned int lba) {
+    uint32_t hash = (lba * 2654435761u) ^ idisk->id;
+    return &disk_cache.hash[hash & (RAOS_DISK_CACHE_HASH_SIZE - 1)];
+}
+
+
+// disk_cache.lock must be held.
+static void disk_cache_lru_unlink(struct disk_cache_block* block) {
+    if (block->lru_prev) {
+        block->lru_prev->lru_next = block->lru_next;
+    } else {
+        disk_cache.lru_head = block->lru_next;
+    }
+
+    if (block->lru_next) {
+        block->lru_next->lru_prev = block->lru_prev;
+    } else {
+        disk_cache.lru_tail = block->lru_prev;
+    }
 }
 
 
+// disk_cache.lock must be held.
+static void disk_cache_lru_push(struct disk_cache_block* block) {
+    block->lru_prev = 0;
+    block->lru_next = disk_cache.lru_head;
+    if (disk_cache.lru_head) {
+        disk_cache.lru_head->lru_prev = block;
+    } else {
+        disk_cache.lru_tail = block;
+    }
+    disk_cache.lru_head = block;
+}
+
+
+// disk_cache.lock must be held.
+static struct disk_cache_block* disk_cache_find(struct disk* idisk,
+                                                unsigned int lba) {
+    struct disk_cache_block* block = *disk_cache_bucket(idisk, lba);
+    while (block && (block->disk != idisk || block->lba != lba)) {
+        block = block->hash_next;
+    }
+
+    return block;
+}
+
+
+static void disk_cache_init() {
+    disk_cache.blocks =
+        kzalloc(sizeof(struct disk_cache_block) * RAOS_DISK_CACHE_BLOCKS);
+    if (!disk_cache.blocks) {
+        // Run uncached.
+        return;
+    }
+
+    for (int i = 0; i < RAOS_DISK_CACHE_BLOCKS; ++i) {
+        disk_cache_lru_push(&disk_cache.blocks[i]);
+    }
+}
+
+
+/**
+ * @brief Copy a sector out of the cache and mark it most recently used.
+ *
+ * @param idisk
+ * @param lba
+ * @param buf RAOS_SECTOR_SIZE bytes
+ * @return true on a hit
+ */
+static bool disk_cache_read(struct disk* idisk, unsigned int lba, void* buf) {
+    if (!disk_cache.blocks) {
+        return false;
+    }
+
+    uint32_t                 flags = spin_lock_irqsave(&disk_cache.lock);
+    struct disk_cache_block* block = disk_cache_find(idisk, lba);
+    if (block) {
+        memcpy(buf, block->data, RAOS_SECTOR_SIZE);
+        disk_cache_lru_unlink(block);
+        disk_cache_lru_push(block);
+        disk_cache.hits++;
+    } else {
+        disk_cache.misses++;
+    }
+    spin_unlock_irqrestore(&disk_cache.lock, flags);
+
+    return block != 0;
+}
+
+
+/**
+ * @brief The block of a sector, recycling the least recently used clean
+ *        block when it is not cached. disk_cache.lock must be held.
+ *
+ * @param idisk
+ * @param lba
+ * @return struct disk_cache_block* 0 when every block waits for write back
+ */
+static struct disk_cache_block* disk_cache_get(struct disk* idisk,
+                                               unsigned int lba) {
+    struct disk_cache_block* block = disk_cache_find(idisk, lba);
+    if (block) {
+        return block;
+    }
+
+    block = disk_cache.lru_tail;
+    while (block && (block->dirty || block->writing)) {
+        block = block->lru_prev;
+    }
+
+    if (!block) {
+        return 0;
+    }
+
+    if (block->disk) {
+        struct disk_cache_block** pp = disk_cache_bucket(block->disk, block->lba);
+        while (*pp != block) {
+            pp = &(*pp)->hash_next;
+        }
+        *pp = block->hash_next;
+    }
+
+    struct disk_cache_block** bucket = disk_cache_bucket(idisk, lba);
+    block->disk      = idisk;
+    block->lba       = lba;
+    block->hash_next = *bucket;
+    *bucket          = block;
+    return block;
+}
+
+
+// Whether a sector is cached, without counting a hit or a miss.
+static bool disk_cache_contains(struct disk* idisk, unsigned int lba) {
+    uint32_t flags  = spin_lock_irqsave(&disk_cache.lock);
+    bool     cached = disk_cache_find(idisk, lba) != 0;
+    spin_unlock_irqrestore(&disk_cache.lock, flags);
+    return cached;
+}
+
+
+/**
+ * @brief Put a sector read from the disk into the cache.
+ *
+ * @param idisk
+ * @param lba
+ * @param buf RAOS_SECTOR_SIZE bytes
+ */
+static void disk_cache_insert(struct disk* idisk, unsigned int lba,
+                              void* buf) {
+    if (!disk_cache.blocks) {
+        return;
+    }
+
+    uint32_t                 flags = spin_lock_irqsave(&disk_cache.lock);
+    // Another CPU may have read the same sector meanwhile.
+    struct disk_cache_block* block = disk_cache_get(idisk, lba);
+    // A dirty block is newer than what was read.
+    if (block && !block->dirty) {
+        memcpy(block->data, buf, RAOS_SECTOR_SIZE);
+        disk_cache_lru_unlink(block);
+        disk_cache_lru_push(block);
+    }
+    spin_unlock_irqrestore(&disk_cache.lock, flags);
+}
+
+
+// Body of the write-back task, flushes every drive each time it is due.
+static void disk_writeback_main(void* data) {
+    while (1) {
+        uint32_t flags = spin_lock_irqsave(&disk_cache.lock);
+        while (!disk_cache.writeback_due) {
+            // Blocked under the lock, disk_writeback_timeout() sets due
+            // before waking us.
+            flags = task_wait(&disk_cache.lock, flags);
+        }
+        disk_cache.writeback_due = false;
+        spin_unlock_irqrestore(&disk_cache.lock, flags);
+
+        for (int i = 0; i < disk_count; ++i) {
+            if (disks[i].type == RAOS_DISK_TYPE_REAL) {
+                disk_flush(&disks[i]);
+            }
+        }
+    }
+}
+
+
+static void disk_writeback_timeout(void* data) {
+    uint32_t flags = spin_lock_irqsave(&disk_cache.lock);
+    disk_cache.writeback_due = true;
+    spin_unlock_irqrestore(&disk_cache.lock, flags);
+    task_wakeup(disk_cache.writeback_task);
+}
+
+
+/**
+ * @brief Put a sector written by the caller into the cache and mark it
+ *        dirty. disk_cache.lock must be held.
+ *
+ * @param idisk
+ * @param lba
+ * @param buf RAOS_SECTOR_SIZE bytes
+ * @return false when every block waits for write back
+ */
+static bool disk_cache_write(struct disk* idisk, unsigned int lba, void* buf) {
+    struct disk_cache_block* block = disk_cache_get(idisk, lba);
+    if (!block) {
+        return false;
+    }
+
+    memcpy(block->data, buf, RAOS_SECTOR_SIZE);
+    disk_cache_lru_unlink(block);
+    disk_cache_lru_push(block);
+    if (!block->dirty) {
+        block->dirty = true;
+        disk_cache.dirty++;
+    }
+
+    if (!timer_pending(&disk_cache.writeback_timer)) {
+        timer_add(&disk_cache.writeback_timer, RAOS_DISK_WRITEBACK_MS);
+    }
+
+    return true;
+}
+
+
+void disk_cache_print_stats() {
+    char buf[16];
+    print("disk cache hits ");
+    print(uitoa(disk_cache.hits, buf, 10));
+    print(" misses ");
+    print(uitoa(disk_cache.misses, buf, 10));
+    print(" dirty ");
+    print(uitoa(disk_cache.dirty, buf, 10));
+    print(" written ");
+    print(uitoa(disk_cache.written, buf, 10));
+    print("\n");
+}
+
+
+// Take the next slot of the disk table.
+static struct disk* disk_new(RAOS_DISK_TYPE type) {
+    if (disk_count >= RAOS_MAX_DISKS) {
+        return 0;
+    }
+
+    struct disk* idisk = &disks[disk_count];
+    memset(idisk, 0, sizeof(struct disk));
+    idisk->type        = type;
+    idisk->sector_size = RAOS_SECTOR_SIZE;
+    idisk->id          = disk_count++;
+    return idisk;
+}
+
+
+/**
+ * @brief Add the drive at a channel position when it answers IDENTIFY.
+ *
+ * @param channel 0 primary, 1 secondary
+ * @param slave
+ */
+static void disk_probe(int channel, bool slave) {
+    struct disk probe = {
+        .io_base      = channel ? ATA_SECONDARY_IO : ATA_PRIMARY_IO,
+        .drive_select = slave ? 0xF0 : 0xE0,
+        .queue        = &disk_channel_queues[channel],
+    };
+
+    if (disk_identify(&probe) < 0) {
+        return;
+    }
+
+    struct disk* idisk = disk_new(RAOS_DISK_TYPE_REAL);
+    if (!idisk) {
+        return;
+    }
+
+    idisk->io_base      = probe.io_base;
+    idisk->drive_select = probe.drive_select;
+    idisk->sectors      = probe.sectors;
+    idisk->queue        = probe.queue;
+}
+
+
+/**
+ * @brief Add the primary partitions of the MBR of a drive as disks of their
+ *        own. Bytes at the table offset of a boot sector without one are
+ *        code, entries that do not fit the drive are skipped.
+ *
+ * @param drive
+ */
+static void disk_scan_partitions(struct disk* drive) {
+    uint8_t mbr[RAOS_SECTOR_SIZE] __attribute__((aligned(4)));
+    if (disk_read_block(drive, 0, 1, mbr) < 0 || mbr[510] != 0x55
+        || mbr[511] != 0xAA) {
+        return;
+    }
+
+    struct mbr_partition* table = (struct mbr_partition*)(mbr + MBR_PARTITION_TABLE);
+    for (int i = 0; i < MBR_PARTITIONS; ++i) {
+        struct mbr_partition* entry = &table[i];
+        // Extended partitions (0x05, 0x0F) hold further tables, not data.
+        if (entry->type == 0 || entry->type == 0x05 || entry->type == 0x0F
+            || (entry->status != 0 && entry->status != 0x80)
+            || entry->lba_first == 0 || entry->sectors == 0
+            || entry->lba_first >= drive->sectors
+            || entry->sectors > drive->sectors - entry->lba_first) {
+            continue;
+        }
+
+        struct disk* partition = disk_new(RAOS_DISK_TYPE_PARTITION);
+        if (!partition) {
+            return;
+        }
+
+        partition->parent     = drive;
+        partition->lba_offset = entry->lba_first;
+        partition->sectors    = entry->sectors;
+        partition->queue      = drive->queue;
+        partition->filesystem = fs_resolve(partition);
+    }
+}
+
+
+/**
+ * @brief Find the ATA drives on both channels and the partitions on them,
+ *        then the filesystem of each. A drive formatted as a whole is not
+ *        searched for partitions.
+ *
+ */
 void disk_search_and_init() {
-    memset(&disk, 0, sizeof(disk));
-    disk.type        = RAOS_DISK_TYPE_REAL;
-    disk.sector_size = RAOS_SECTOR_SIZE;
-    disk.id          = 0;
-    disk.filesystem  = fs_resolve(&disk);
+    disk_cache_init();
+    timer_setup(&disk_cache.writeback_timer, disk_writeback_timeout, 0);
+    if (disk_cache.blocks) {
+        disk_cache.writeback_task = task_new_kernel(disk_writeback_main, 0,
+                                                    TASK_AFFINITY_ANY);
+        if (ISERR(disk_cache.writeback_task)) {
+            panic("disk_search_and_init(): No write-back task\n");
+        }
+    }
+
+    // Only IRQ14 has a handler, the secondary channel is polled.
+    outb(ATA_SECONDARY_CONTROL, ATA_CONTROL_NIEN);
+    for (int channel = 0; channel < 2; ++channel) {
+        disk_queue_init(&disk_channel_queues[channel]);
+        disk_probe(channel, false);
+        disk_probe(channel, true);
+    }
+
+    int drives = disk_count;
+    for (int i = 0; i < drives; ++i) {
+        disks[i].filesystem = fs_resolve(&disks[i]);
+        if (!disks[i].filesystem) {
+            disk_scan_partitions(&disks[i]);
+        }
+    }
+
+    if (RAOS_RAMDISK_IMAGE >= 0 || RAOS_RAMDISK_SECTORS > 0) {
+        disk_ramdisk_new(RAOS_RAMDISK_SECTORS, disk_get(RAOS_RAMDISK_IMAGE));
+    }
 }
 
 
@@ -63,12 +662,140 @@ void disk_search_and_init() {
  * @return struct disk*
  */
 struct disk* disk_get(int index) {
-    // TODO: this is simple implementation when only one disk exists.
-    if (0 != index) {
+    if (index < 0 || index >= disk_count) {
         return 0;
     }
 
-    return &disk;
+    return &disks[index];
+}
+
+
+/**
+ * @brief Check a transfer against the size of a disk and move a partition's
+ *        sectors onto its drive, the cache and the queue work on drives.
+ *
+ * @param idisk in/out
+ * @param lba in/out
+ * @param total
+ * @return int
+ */
+static int disk_resolve(struct disk** idisk, unsigned int* lba, int total) {
+    struct disk* d = *idisk;
+    if (!d || total < 0 || *lba > d->sectors
+        || (unsigned int)total > d->sectors - *lba) {
+        return -EINVARG;
+    }
+
+    if (d->type == RAOS_DISK_TYPE_PARTITION) {
+        *lba += d->lba_offset;
+        *idisk = d->parent;
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief Read sectors through the request queue of the disk. DMA needs an
+ *        even address, an odd buffer is read through a bounce buffer.
+ *
+ * @param idisk
+ * @param lba
+ * @param total at most DISK_MAX_READ_SECTORS
+ * @param buf
+ * @return int
+ */
+static int disk_read_uncached(struct disk* idisk, unsigned int lba, int total,
+                              void* buf) {
+    if (!((uint32_t)buf & 1)) {
+        return disk_queue_transfer(idisk, DISK_REQUEST_READ, lba, total, buf);
+    }
+
+    void* bounce = kmalloc(total * RAOS_SECTOR_SIZE);
+    if (!bounce) {
+        return -ENOMEM;
+    }
+
+    int res = disk_queue_transfer(idisk, DISK_REQUEST_READ, lba, total, bounce);
+    if (res == 0) {
+        memcpy(buf, bounce, total * RAOS_SECTOR_SIZE);
+    }
+    kfree(bounce);
+    return res;
+}
+
+
+/**
+ * @brief Add a disk kept in kernel memory, a filesystem on it is resolved
+ *        like on a drive. Copying an image in is the only way to give it
+ *        one, FAT16 cannot format.
+ *
+ * @param sectors size, 0 for the size of the image
+ * @param image disk copied into the RAM disk, 0 for a blank one
+ * @return struct disk* 0 on failure
+ */
+struct disk* disk_ramdisk_new(unsigned int sectors, struct disk* image) {
+    struct disk* idisk = 0;
+    char*        ram   = 0;
+    if (!sectors && image) {
+        sectors = image->sectors;
+    }
+
+    if (!sectors || sectors > RAOS_HEAP_SIZE_BYTES / RAOS_SECTOR_SIZE) {
+        goto out;
+    }
+
+    ram = kzalloc(sectors * RAOS_SECTOR_SIZE);
+    if (!ram) {
+        goto out;
+    }
+
+    if (image) {
+        // The copy reads past the block cache, what is dirty there goes to
+        // the drive first.
+        if (disk_flush(image) < 0) {
+            goto out;
+        }
+
+        unsigned int copy = sectors < image->sectors ? sectors : image->sectors;
+        for (unsigned int lba = 0; lba < copy; lba += DISK_MAX_READ_SECTORS) {
+            int total = DISK_MAX_READ_SECTORS;
+            if (copy - lba < DISK_MAX_READ_SECTORS) {
+                total = copy - lba;
+            }
+
+            // Past the block cache, the image would only evict it.
+            struct disk* drive = image;
+            unsigned int at    = lba;
+            char*        out   = ram + lba * RAOS_SECTOR_SIZE;
+            int          res   = disk_resolve(&drive, &at, total);
+            if (res == 0) {
+                res = drive->type == RAOS_DISK_TYPE_RAM
+                          ? disk_read_block(drive, at, total, out)
+                          : disk_read_uncached(drive, at, total, out);
+            }
+
+            if (res < 0) {
+                goto out;
+            }
+        }
+    }
+
+    idisk = disk_new(RAOS_DISK_TYPE_RAM);
+    if (!idisk) {
+        goto out;
+    }
+
+    idisk->sectors    = sectors;
+    idisk->ram        = ram;
+    idisk->filesystem = fs_resolve(idisk);
+
+out:
+    if (!idisk) {
+        kfree(ram);
+    }
+
+    return idisk;
 }
 
 
@@ -83,9 +810,305 @@ struct disk* disk_get(int index) {
  */
 int disk_read_block(struct disk* idisk, unsigned int lba, int total,
                     void* buf) {
-    if (idisk != &disk) {
-        return -EIO;
+    int res = disk_resolve(&idisk, &lba, total);
+    if (res < 0) {
+        return res;
     }
 
-    return disk_read_sector(lba, total, buf);
-}
\ No newline at end of file
+    if (idisk->type == RAOS_DISK_TYPE_RAM) {
+        memcpy(buf, idisk->ram + lba * RAOS_SECTOR_SIZE, total * RAOS_SECTOR_SIZE);
+        return 0;
+    }
+
+    char* out = buf;
+    for (int i = 0; i < total;) {
+        if (disk_cache_read(idisk, lba + i, out + i * RAOS_SECTOR_SIZE)) {
+            ++i;
+            continue;
+        }
+
+        // Read the whole run of missing sectors with one command. The
+        // lookup ending the run already copied its sector on a hit.
+        int  run = 1;
+        bool hit = false;
+        while (i + run < total && run < DISK_MAX_READ_SECTORS) {
+            hit = disk_cache_read(idisk, lba + i + run,
+                                  out + (i + run) * RAOS_SECTOR_SIZE);
+            if (hit) {
+                break;
+            }
+            ++run;
+        }
+
+        res = disk_read_uncached(idisk, lba + i, run, out + i * RAOS_SECTOR_SIZE);
+        if (res < 0) {
+            goto out;
+        }
+
+        for (int j = 0; j < run; ++j) {
+            disk_cache_insert(idisk, lba + i + j,
+                              out + (i + j) * RAOS_SECTOR_SIZE);
+        }
+
+        i += run + (hit ? 1 : 0);
+    }
+
+out:
+    return res;
+}
+
+
+// A readahead finished, keep what it read.
+static void disk_readahead_done(struct disk_request* request) {
+    if (request->status == 0) {
+        char* in = request->buf;
+        for (int i = 0; i < request->total; ++i) {
+            disk_cache_insert(request->disk, request->lba + i,
+                              in + i * RAOS_SECTOR_SIZE);
+        }
+    }
+
+    kfree(request->buf);
+    kfree(request);
+}
+
+
+/**
+ * @brief Start reading sectors into the block cache without waiting for
+ *        them, for data the caller expects to be asked for soon. Cached
+ *        sectors are skipped. With DMA the reads run in the background,
+ *        the PIO fallback transfers them before returning.
+ *
+ * @param idisk
+ * @param lba
+ * @param total
+ */
+void disk_readahead(struct disk* idisk, unsigned int lba, int total) {
+    if (disk_resolve(&idisk, &lba, total) < 0 || idisk->type == RAOS_DISK_TYPE_RAM
+        || !disk_cache.blocks) {
+        return;
+    }
+
+    for (int i = 0; i < total;) {
+        if (disk_cache_contains(idisk, lba + i)) {
+            ++i;
+            continue;
+        }
+
+        int run = 1;
+        while (i + run < total && run < DISK_MAX_READ_SECTORS
+               && !disk_cache_contains(idisk, lba + i + run)) {
+            ++run;
+        }
+
+        struct disk_request* request = kzalloc(sizeof(struct disk_request));
+        void*                buf     = kmalloc(run * RAOS_SECTOR_SIZE);
+        if (!request || !buf) {
+            kfree(buf);
+            kfree(request);
+            return;
+        }
+
+        request->op       = DISK_REQUEST_READ;
+        request->lba      = lba + i;
+        request->total    = run;
+        request->buf      = buf;
+        request->complete = disk_readahead_done;
+        disk_queue_submit(idisk, request);
+
+        i += run;
+    }
+}
+
+
+/**
+ * @brief Write through the request queue, for sectors the cache has no room
+ *        for.
+ *
+ * @param idisk
+ * @param lba
+ * @param buf RAOS_SECTOR_SIZE bytes
+ * @return int
+ */
+static int disk_write_uncached(struct disk* idisk, unsigned int lba,
+                               void* buf) {
+    if (!((uint32_t)buf & 1)) {
+        return disk_queue_transfer(idisk, DISK_REQUEST_WRITE, lba, 1, buf);
+    }
+
+    void* bounce = kmalloc(RAOS_SECTOR_SIZE);
+    if (!bounce) {
+        return -ENOMEM;
+    }
+
+    memcpy(bounce, buf, RAOS_SECTOR_SIZE);
+    int res = disk_queue_transfer(idisk, DISK_REQUEST_WRITE, lba, 1, bounce);
+    kfree(bounce);
+    return res;
+}
+
+
+/**
+ * @brief Abstraction function to write data sectors to disk. The sectors
+ *        land in the block cache and reach the disk with the next
+ *        disk_flush().
+ *
+ * @param idisk get from disk_get()
+ * @param lba logical block address.
+ * @param total total sectors to write.
+ * @param buf data to write
+ * @return int
+ */
+int disk_write_block(struct disk* idisk, unsigned int lba, int total,
+                     void* buf) {
+    int res = disk_resolve(&idisk, &lba, total);
+    if (res < 0) {
+        return res;
+    }
+
+    if (idisk->type == RAOS_DISK_TYPE_RAM) {
+        memcpy(idisk->ram + lba * RAOS_SECTOR_SIZE, buf, total * RAOS_SECTOR_SIZE);
+        return 0;
+    }
+
+    char* in = buf;
+    for (int i = 0; i < total; ++i) {
+        void* sector = in + i * RAOS_SECTOR_SIZE;
+        bool  cached = false;
+        if (disk_cache.blocks) {
+            uint32_t flags = spin_lock_irqsave(&disk_cache.lock);
+            cached         = disk_cache_write(idisk, lba + i, sector);
+            spin_unlock_irqrestore(&disk_cache.lock, flags);
+
+            if (!cached) {
+                // All dirty, make room and try again.
+                disk_flush(idisk);
+                flags  = spin_lock_irqsave(&disk_cache.lock);
+                cached = disk_cache_write(idisk, lba + i, sector);
+                spin_unlock_irqrestore(&disk_cache.lock, flags);
+            }
+        }
+
+        if (!cached) {
+            res = disk_write_uncached(idisk, lba + i, sector);
+            if (res < 0) {
+                goto out;
+            }
+        }
+    }
+
+out:
+    return res;
+}
+
+
+// Sort blocks by lba, so the queue can merge neighbours.
+static void disk_flush_sort(struct disk_cache_block** blocks, int count) {
+    for (int i = 1; i < count; ++i) {
+        struct disk_cache_block* block = blocks[i];
+        int                      j     = i - 1;
+        while (j >= 0 && blocks[j]->lba > block->lba) {
+            blocks[j + 1] = blocks[j];
+            --j;
+        }
+        blocks[j + 1] = block;
+    }
+}
+
+
+/**
+ * @brief Write the dirty blocks of a disk back and flush the write cache of
+ *        the drive. All writes are queued before the first one is waited
+ *        for, so adjacent sectors go out as one command. A block written
+ *        again meanwhile stays dirty.
+ *
+ * @param idisk
+ * @return int
+ */
+int disk_flush(struct disk* idisk) {
+    unsigned int lba = 0;
+    int          res = disk_resolve(&idisk, &lba, 0);
+    if (res < 0 || !disk_cache.blocks || idisk->type == RAOS_DISK_TYPE_RAM) {
+        return res;
+    }
+
+    struct disk_cache_block** blocks   = 0;
+    struct disk_request*     requests = 0;
+    char*                    copies   = 0;
+    int                      count    = 0;
+
+    mutex_lock(&disk_cache.flush_lock);
+    blocks   = kmalloc(sizeof(struct disk_cache_block*) * RAOS_DISK_CACHE_BLOCKS);
+    requests = kzalloc(sizeof(struct disk_request) * RAOS_DISK_CACHE_BLOCKS);
+    copies   = kmalloc(RAOS_SECTOR_SIZE * RAOS_DISK_CACHE_BLOCKS);
+    if (!blocks || !requests || !copies) {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&disk_cache.lock);
+    for (int i = 0; i < RAOS_DISK_CACHE_BLOCKS; ++i) {
+        struct disk_cache_block* block = &disk_cache.blocks[i];
+        if (block->disk == idisk && block->dirty) {
+            block->dirty   = false;
+            block->writing = true;
+            disk_cache.dirty--;
+            blocks[count++] = block;
+        }
+    }
+
+    disk_flush_sort(blocks, count);
+    // The drive gets a snapshot: a write to the block meanwhile only dirties
+    // it again, it never changes a sector half way through the transfer.
+    for (int i = 0; i < count; ++i) {
+        memcpy(copies + i * RAOS_SECTOR_SIZE, blocks[i]->data, RAOS_SECTOR_SIZE);
+    }
+    spin_unlock_irqrestore(&disk_cache.lock, flags);
+
+    if (!count) {
+        goto out;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        requests[i].op    = DISK_REQUEST_WRITE;
+        requests[i].lba   = blocks[i]->lba;
+        requests[i].total = 1;
+        requests[i].buf   = copies + i * RAOS_SECTOR_SIZE;
+        disk_queue_submit(idisk, &requests[i]);
+    }
+
+    for (int i = 0; i < count; ++i) {
+        int status = disk_queue_wait(idisk, &requests[i]);
+
+        flags = spin_lock_irqsave(&disk_cache.lock);
+        blocks[i]->writing = false;
+        if (status < 0) {
+            if (!blocks[i]->dirty) {
+                blocks[i]->dirty = true;
+                disk_cache.dirty++;
+            }
+            res = status;
+        } else {
+            disk_cache.written++;
+        }
+        spin_unlock_irqrestore(&disk_cache.lock, flags);
+    }
+
+    if (res < 0) {
+        goto out;
+    }
+
+    // The drive has the data, make it persist them.
+    struct disk_request exclusive = {.op = DISK_REQUEST_EXCLUSIVE};
+    disk_queue_submit(idisk, &exclusive);
+    disk_queue_wait(idisk, &exclusive);
+    res = disk_flush_drive(idisk);
+    disk_queue_release(idisk);
+
+out:
+    kfree(copies);
+    kfree(requests);
+    kfree(blocks);
+    mutex_unlock(&disk_cache.flush_lock);
+    return res;
+}
@@ -2,24 +2,85 @@
 #define _DISK_H
 
 #include "../fs/file.h"
+#include "queue.h"
 
 typedef unsigned int RAOS_DISK_TYPE;
 
 // Represent a real physical hard disk
 #define RAOS_DISK_TYPE_REAL 0
+// A partition of a real disk, its sectors are forwarded to the drive.
+#define RAOS_DISK_TYPE_PARTITION 1
+// Sectors in kernel memory, they bypass the block cache.
+#define RAOS_DISK_TYPE_RAM 2
+
+// Task files of the two channels, registers at offsets from the I/O base.
+#define ATA_PRIMARY_IO 0x1F0
+#define ATA_PRIMARY_COMMAND_STATUS 0x1F7
+#define ATA_SECONDARY_IO 0x170
+#define ATA_SECONDARY_CONTROL 0x376
+
+#define ATA_REG_DATA 0
+#define ATA_REG_SECTOR_COUNT 2
+#define ATA_REG_LBA_LOW 3
+#define ATA_REG_LBA_MID 4
+#define ATA_REG_LBA_HIGH 5
+#define ATA_REG_DRIVE 6
+#define ATA_REG_COMMAND_STATUS 7
+
+#define ATA_CONTROL_NIEN 0x02  // no interrupts from the channel
+
+#define ATA_COMMAND_IDENTIFY 0xEC
+#define ATA_COMMAND_READ_PIO 0x20
+#define ATA_COMMAND_WRITE_PIO 0x30
+#define ATA_COMMAND_READ_DMA 0xC8
+#define ATA_COMMAND_WRITE_DMA 0xCA
+#define ATA_COMMAND_FLUSH_CACHE 0xE7
+
+#define ATA_STATUS_ERR 0x01
+#define ATA_STATUS_DRQ 0x08
+#define ATA_STATUS_DF  0x20
+#define ATA_STATUS_BSY 0x80
+
+// Most sectors one ATA read command transfers, its count register is 8 bits
+// wide and 0 stands for 256.
+#define DISK_MAX_READ_SECTORS 256
 
 struct disk {
     RAOS_DISK_TYPE type;
     int            sector_size;
     int            id;
+    unsigned int   sectors;
+
+    // ATA drive of a real disk.
+    unsigned short io_base;
+    unsigned char  drive_select;  // 0xE0 master, 0xF0 slave, LBA mode
+
+    // Drive and first sector of a partition.
+    struct disk* parent;
+    unsigned int lba_offset;
+
+    // Sectors of a RAM disk.
+    char* ram;
 
     struct filesystem* filesystem;
     void*              fs_private;  // used for internel interpratation
+
+    // Requests waiting for the channel, master and slave share it.
+    struct disk_queue* queue;
 };
 
 struct disk* disk_get(int index);
 
 void disk_search_and_init();
+int  disk_read_sector(struct disk* idisk, int lba, int total, void* buf);
+int  disk_write_sector(struct disk* idisk, int lba, int total, void* buf);
+int  disk_flush_drive(struct disk* idisk);
+int  disk_write_block(struct disk* idisk, unsigned int lba, int total,
+                      void* buf);
+int  disk_flush(struct disk* idisk);
 int disk_read_block(struct disk* idisk, unsigned int lba, int total, void* buf);
+void disk_readahead(struct disk* idisk, unsigned int lba, int total);
+struct disk* disk_ramdisk_new(unsigned int sectors, struct disk* image);
+void disk_cache_print_stats();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,330 @@
+#include "queue.h"
+#include "../config.h"
+#include "../cpu/cpu.h"
+#include "../idt/idt.h"
+#include "../kernel.h"
+#include "../string/string.h"
+#include "../task/task.h"
+#include "../timer/timer.h"
+#include "ata_dma.h"
+#include "disk.h"
+
+
+void disk_queue_init(struct disk_queue* queue) {
+    spin_lock_init(&queue->lock, "disk_queue");
+    queue->head       = 0;
+    queue->active     = 0;
+    queue->position   = 0;
+    queue->dispatched = 0;
+    queue->merged     = 0;
+}
+
+
+// queue->lock must be held.
+static void disk_queue_insert(struct disk_queue* queue,
+                              struct disk_request* request) {
+    struct disk_request** pp = &queue->head;
+    while (*pp && (*pp)->lba <= request->lba) {
+        pp = &(*pp)->next;
+    }
+
+    request->next = *pp;
+    *pp           = request;
+}
+
+
+// queue->lock must be held.
+static void disk_queue_unlink(struct disk_queue* queue,
+                              struct disk_request* request) {
+    struct disk_request** pp = &queue->head;
+    while (*pp != request) {
+        pp = &(*pp)->next;
+    }
+
+    *pp = request->next;
+}
+
+
+/**
+ * @brief The request to serve next: an expired one, the oldest first,
+ *        otherwise the next one upwards from the head position, wrapping
+ *        round to the lowest lba. queue->lock must be held.
+ *
+ * @param queue
+ * @return struct disk_request*
+ */
+static struct disk_request* disk_queue_pick(struct disk_queue* queue) {
+    uint32_t             now     = timer_ticks();
+    struct disk_request* expired = 0;
+    for (struct disk_request* r = queue->head; r; r = r->next) {
+        if ((int32_t)(now - r->deadline) >= 0
+            && (!expired || (int32_t)(r->deadline - expired->deadline) < 0)) {
+            expired = r;
+        }
+    }
+
+    if (expired) {
+        return expired;
+    }
+
+    for (struct disk_request* r = queue->head; r; r = r->next) {
+        if (r->lba >= queue->position) {
+            return r;
+        }
+    }
+
+    return queue->head;
+}
+
+
+/**
+ * @brief Take the next request off the queue together with the ones that
+ *        continue it on disk, up to one command. queue->lock must be held.
+ *
+ * @param queue
+ * @return struct disk_request* the batch, linked through batch_next
+ */
+static struct disk_request* disk_queue_take_batch(struct disk_queue* queue) {
+    struct disk_request* first = disk_queue_pick(queue);
+    disk_queue_unlink(queue, first);
+    first->batch_next = 0;
+
+    struct disk_request* last  = first;
+    int                  total = first->total;
+    if (first->op == DISK_REQUEST_EXCLUSIVE) {
+        queue->dispatched++;
+        return first;
+    }
+
+    int                  count = 1;
+    // The queue is sorted, a continuation sits at or after first's place.
+    struct disk_request* r     = first->next;
+    while (r && count < RAOS_DISK_QUEUE_MAX_MERGE) {
+        struct disk_request* next = r->next;
+        if (r->lba > last->lba + last->total) {
+            break;
+        }
+
+        if (r->lba == last->lba + last->total && r->op == first->op
+            && r->disk == first->disk
+            && total + r->total <= DISK_MAX_READ_SECTORS) {
+            disk_queue_unlink(queue, r);
+            r->batch_next    = 0;
+            last->batch_next = r;
+            last             = r;
+            total += r->total;
+            ++count;
+            queue->merged++;
+        }
+        r = next;
+    }
+
+    queue->position = last->lba + last->total;
+    queue->dispatched++;
+    return first;
+}
+
+
+/**
+ * @brief Complete the active batch and wake its waiters.
+ *
+ * @param queue
+ * @param status
+ */
+static void disk_queue_finish(struct disk_queue* queue, int status) {
+    uint32_t           flags = spin_lock_irqsave(&queue->lock);
+    struct disk_request* r   = queue->active;
+    queue->active            = 0;
+
+    struct disk_request* completed = 0;
+    while (r) {
+        // The waiter checks done under the lock, r stays valid until then.
+        struct disk_request* next = r->batch_next;
+        r->status                 = status;
+        r->done                   = true;
+        if (r->complete) {
+            r->next   = completed;
+            completed = r;
+        } else if (r->waiter) {
+            task_wakeup(r->waiter);
+        }
+        r = next;
+    }
+    spin_unlock_irqrestore(&queue->lock, flags);
+
+    while (completed) {
+        struct disk_request* next = completed->next;
+        completed->complete(completed);
+        completed = next;
+    }
+}
+
+
+static void disk_queue_run(struct disk_queue* queue);
+
+static void disk_queue_dma_done(void* data, int status) {
+    struct disk_queue* queue = data;
+    disk_queue_finish(queue, status);
+    disk_queue_run(queue);
+}
+
+
+/**
+ * @brief Send batches to the drive while it is idle. With DMA the first
+ *        batch is left in flight and IRQ14 continues from there, PIO
+ *        batches are transferred right here. An exclusive request keeps
+ *        the drive until disk_queue_release(). Bus mastering is set up
+ *        for the primary channel only.
+ *
+ * @param queue
+ */
+static void disk_queue_run(struct disk_queue* queue) {
+    uint32_t           flags = spin_lock_irqsave(&queue->lock);
+    while (!queue->active && queue->head) {
+        struct disk_request* batch = disk_queue_take_batch(queue);
+        queue->active              = batch;
+        if (batch->op == DISK_REQUEST_EXCLUSIVE) {
+            batch->done = true;
+            if (batch->waiter) {
+                task_wakeup(batch->waiter);
+            }
+            break;
+        }
+        spin_unlock_irqrestore(&queue->lock, flags);
+
+        int  res   = 0;
+        bool write = batch->op == DISK_REQUEST_WRITE;
+        struct disk* idisk = batch->disk;
+        if (ata_dma_enabled() && idisk->io_base == ATA_PRIMARY_IO) {
+            struct ata_dma_segment segments[RAOS_DISK_QUEUE_MAX_MERGE];
+            int                    count = 0;
+            int                    total = 0;
+            for (struct disk_request* r = batch; r; r = r->batch_next) {
+                segments[count].buf   = r->buf;
+                segments[count].bytes = r->total * RAOS_SECTOR_SIZE;
+                total += r->total;
+                ++count;
+            }
+
+            res = ata_dma_start(idisk, batch->lba, total, write, segments,
+                                count, disk_queue_dma_done, queue);
+            if (res == 0) {
+                return;
+            }
+        } else {
+            for (struct disk_request* r = batch; r && res == 0; r = r->batch_next) {
+                res = write ? disk_write_sector(idisk, r->lba, r->total, r->buf)
+                            : disk_read_sector(idisk, r->lba, r->total, r->buf);
+            }
+        }
+
+        disk_queue_finish(queue, res);
+        flags = spin_lock_irqsave(&queue->lock);
+    }
+    spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+
+/**
+ * @brief Queue a request, the caller fills in op, lba, total and buf and
+ *        waits for it with disk_queue_wait() or sets complete. Requests queued before the
+ *        drive gets to them may be merged.
+ *
+ * @param idisk a drive, not a partition
+ * @param request
+ */
+void disk_queue_submit(struct disk* idisk, struct disk_request* request) {
+    struct disk_queue* queue = idisk->queue;
+    request->disk     = idisk;
+    request->deadline =
+        timer_ticks() + RAOS_DISK_QUEUE_DEADLINE_MS / TIMER_MS_PER_TICK;
+    request->done   = false;
+    request->status = 0;
+    request->waiter = 0;
+
+    uint32_t flags = spin_lock_irqsave(&queue->lock);
+    disk_queue_insert(queue, request);
+    spin_unlock_irqrestore(&queue->lock, flags);
+
+    disk_queue_run(queue);
+}
+
+
+/**
+ * @brief Wait for a submitted request. The requesting task sleeps while the
+ *        drive works, without a task the controller is polled.
+ *
+ * @param idisk
+ * @param request
+ * @return int
+ */
+int disk_queue_wait(struct disk* idisk, struct disk_request* request) {
+    if (idt_in_interrupt()) {
+        panic("disk_queue_wait(): Called in interrupt context\n");
+    }
+
+    struct disk_queue* queue = idisk->queue;
+    struct task*       task  = task_current();
+
+    uint32_t flags = spin_lock_irqsave(&queue->lock);
+    while (!request->done) {
+        if (!task) {
+            spin_unlock_irqrestore(&queue->lock, flags);
+            ata_dma_poll();
+            cpu_pause();
+            flags = spin_lock_irqsave(&queue->lock);
+            continue;
+        }
+
+        request->waiter = task;
+        flags = task_wait(&queue->lock, flags);
+    }
+    spin_unlock_irqrestore(&queue->lock, flags);
+
+    return request->status;
+}
+
+
+// End the exclusive request the caller was granted, the queue goes on.
+void disk_queue_release(struct disk* idisk) {
+    struct disk_queue* queue = idisk->queue;
+    uint32_t           flags = spin_lock_irqsave(&queue->lock);
+    queue->active            = 0;
+    spin_unlock_irqrestore(&queue->lock, flags);
+
+    disk_queue_run(queue);
+}
+
+
+/**
+ * @brief Queue one transfer and wait for it.
+ *
+ * @param idisk
+ * @param op DISK_REQUEST_READ or DISK_REQUEST_WRITE
+ * @param lba
+ * @param total sectors, at most DISK_MAX_READ_SECTORS
+ * @param buf an even address
+ * @return int
+ */
+int disk_queue_transfer(struct disk* idisk, int op, unsigned int lba,
+                        int total, void* buf) {
+    struct disk_request request = {
+        .op    = op,
+        .lba   = lba,
+        .total = total,
+        .buf   = buf,
+    };
+
+    disk_queue_submit(idisk, &request);
+    return disk_queue_wait(idisk, &request);
+}
+
+
+void disk_queue_print_stats(struct disk* idisk) {
+    char buf[16];
+    print("disk queue commands ");
+    print(uitoa(idisk->queue->dispatched, buf, 10));
+    print(" merged ");
+    print(uitoa(idisk->queue->merged, buf, 10));
+    print("\n");
+}
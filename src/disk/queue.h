@@ -0,0 +1,62 @@
+#ifndef _DISK_QUEUE_H
+#define _DISK_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../lock/spinlock.h"
+
+struct disk;
+struct task;
+
+enum DiskRequestOp {
+    DISK_REQUEST_READ,
+    DISK_REQUEST_WRITE,
+    // Hands the idle drive to the waiter, for a command outside the queue.
+    // It calls disk_queue_release() when done.
+    DISK_REQUEST_EXCLUSIVE,
+};
+
+// A transfer waiting for the drive, often on the kernel stack of the
+// requesting task.
+struct disk_request {
+    int          op;
+    struct disk* disk;  // drive, set by disk_queue_submit()
+    unsigned int lba;
+    int          total;
+    void*        buf;
+    uint32_t     deadline;  // tick after which it is served first
+
+    volatile bool done;
+    int           status;
+    struct task*  waiter;
+    // Called when done instead of waking a waiter, without the queue lock.
+    void (*complete)(struct disk_request* request);
+
+    struct disk_request* next;        // queue, ascending lba
+    struct disk_request* batch_next;  // merged into one command
+};
+
+// Pending requests of an ATA channel. The elevator sweeps upwards through the
+// sorted queue from the last position served, a request waiting past its
+// deadline is served next. Requests adjacent on the same drive in the same
+// direction go out as one command.
+struct disk_queue {
+    struct spinlock      lock;
+    struct disk_request* head;
+    struct disk_request* active;    // batch the drive is working on
+    unsigned int         position;  // lba after the last batch
+
+    uint32_t dispatched;  // commands
+    uint32_t merged;      // requests that joined another one's command
+};
+
+void disk_queue_init(struct disk_queue* queue);
+void disk_queue_submit(struct disk* idisk, struct disk_request* request);
+int  disk_queue_wait(struct disk* idisk, struct disk_request* request);
+void disk_queue_release(struct disk* idisk);
+int  disk_queue_transfer(struct disk* idisk, int op, unsigned int lba,
+                         int total, void* buf);
+void disk_queue_print_stats(struct disk* idisk);
+
+#endif
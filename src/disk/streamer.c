@@ -1,6 +1,8 @@
 #include "streamer.h"
 #include "../config.h"
 #include "../memory/heap/kheap.h"
+#include "../memory/memory.h"
+#include "../status.h"
 
 
 
@@ -19,13 +21,19 @@ struct disk_stream* diskstreamer_new(int disk_id) {
 
 
 int diskstreamer_seek(struct disk_stream* stream, int pos) {
+    if (pos < 0) {
+        return -EINVARG;
+    }
+
     stream->pos = pos;
     return 0;
 }
 
 /**
- * @brief Read to total bytes to out from disk stream.
- *        NOTE: there is a problem, the recursion may cause stack overflow.
+ * @brief Read to total bytes to out from disk stream. A partial first and
+ *        last sector go through a sector buffer, the whole sectors between
+ *        them are read straight into out, DISK_MAX_READ_SECTORS per command.
+ *        On error the position is past the bytes already copied.
  *
  * @param stream
  * @param out
@@ -33,26 +41,65 @@ int diskstreamer_seek(struct disk_stream* stream, int pos) {
  * @return int
  */
 int diskstreamer_read(struct disk_stream* stream, void* out, int total) {
-    int sector = stream->pos / RAOS_SECTOR_SIZE;
-    int offset = stream->pos % RAOS_SECTOR_SIZE;
+    // The position stays a non-negative int past the read.
+    if (total < 0 || (total > 0 && !out) || stream->pos < 0
+        || total > INT32_MAX - stream->pos) {
+        return -EINVARG;
+    }
 
+    int  res    = 0;
+    int  sector = stream->pos / RAOS_SECTOR_SIZE;
+    int  offset = stream->pos % RAOS_SECTOR_SIZE;
     char buf[RAOS_SECTOR_SIZE];
-    int  res = disk_read_block(stream->disk, sector, 1, buf);
-    if (res < 0) {
-        goto out;
+
+    // Head, from the middle of a sector or less than one sector.
+    if (total > 0 && (offset || total < RAOS_SECTOR_SIZE)) {
+        res = disk_read_block(stream->disk, sector, 1, buf);
+        if (res < 0) {
+            goto out;
+        }
+
+        int count = RAOS_SECTOR_SIZE - offset;
+        if (count > total) {
+            count = total;
+        }
+
+        memcpy(out, buf + offset, count);
+        out += count;
+        total -= count;
+        stream->pos += count;
+        ++sector;
     }
 
-    // read for small size data
-    int total_to_read = total > RAOS_SECTOR_SIZE ? RAOS_SECTOR_SIZE : total;
-    for (int i = 0; i < total_to_read; ++i) {
-        *(char*)out++ = buf[offset + i];
+    // Whole sectors.
+    while (total >= RAOS_SECTOR_SIZE) {
+        int count = total / RAOS_SECTOR_SIZE;
+        if (count > DISK_MAX_READ_SECTORS) {
+            count = DISK_MAX_READ_SECTORS;
+        }
+
+        res = disk_read_block(stream->disk, sector, count, out);
+        if (res < 0) {
+            goto out;
+        }
+
+        out += count * RAOS_SECTOR_SIZE;
+        total -= count * RAOS_SECTOR_SIZE;
+        stream->pos += count * RAOS_SECTOR_SIZE;
+        sector += count;
     }
 
-    // read for big size data
-    stream->pos += total_to_read;
-    if (total > RAOS_SECTOR_SIZE) {
-        res = diskstreamer_read(stream, out, total - RAOS_SECTOR_SIZE);
+    // Tail, the start of the last sector.
+    if (total > 0) {
+        res = disk_read_block(stream->disk, sector, 1, buf);
+        if (res < 0) {
+            goto out;
+        }
+
+        memcpy(out, buf, total);
+        stream->pos += total;
     }
+
 out:
     return res;
 }
@@ -12,7 +12,10 @@
 
 #define RAOS_FAT16_SIGNATURE 0x29
 #define RAOS_FAT16_ENTRY_SIZE 0x02
-#define RAOS_FAT16_BAD_SECTOR 0xFF7
+#define RAOS_FAT16_BAD_SECTOR 0xFFF7
+// 0xFFF0-0xFFF6 are reserved, 0xFFF8 and up end a cluster chain.
+#define RAOS_FAT16_RESERVED 0xFFF0
+#define RAOS_FAT16_END_OF_CHAIN 0xFFF8
 #define RAOS_FAT16_UNUSED 0x00
 
 // Not written to disk, but for us programer to read
@@ -113,6 +116,11 @@ struct fat_item {
 struct fat_file_descriptor {
     struct fat_item* item;
     uint32_t pos;
+
+    // Readahead: a read starting where the last one ended is sequential.
+    uint32_t ra_next;    // end of the last read
+    uint32_t ra_window;  // bytes to stay ahead of the reader, 0 if random
+    uint32_t ra_end;     // end of what was read ahead
 };
 
 
@@ -419,7 +427,7 @@ static inline uint32_t fat16_get_first_cluster_for_directory_item(struct fat_dir
  * @return uint32_t FAT table entry; -EIO: error; -ENOMEM: out of memory
  */
 static uint32_t fat16_get_fat_entry(struct disk* disk, int cluster_pos) {
-    int res = -1;
+    int res = -EIO;
 
     struct fat_private *private = disk->fs_private;
     struct disk_stream *stream = private->fat_read_stream;
@@ -428,12 +436,12 @@ static uint32_t fat16_get_fat_entry(struct disk* disk, int cluster_pos) {
     }
 
     uint32_t fat_table_position = private->header.primary_header.reserved_sectors * disk->sector_size;
-    res = diskstreamer_seek(stream, fat_table_position * (cluster_pos * RAOS_FAT16_ENTRY_SIZE));
+    res = diskstreamer_seek(stream, fat_table_position + (cluster_pos * RAOS_FAT16_ENTRY_SIZE));
     if (res < 0) {
         goto out;
     }
 
-    uint32_t result = 0;
+    uint16_t result = 0;
     res = diskstreamer_read(stream, &result, sizeof(result));
     if (res < 0) {
         goto out;
@@ -445,6 +453,34 @@ out:
 }
 
 
+/**
+ * @brief Follow the FAT chain one cluster.
+ * 
+ * @param disk 
+ * @param cluster_pos 
+ * @return int the next cluster position; -EIO: end of chain or a bad entry
+ */
+static int fat16_get_next_cluster(struct disk* disk, int cluster_pos) {
+    // FAT table entry bytes for cluster.
+    int entry = fat16_get_fat_entry(disk, cluster_pos);
+    if (entry < 0) {
+        return entry;
+    }
+
+    // Last entry of a file, bad sector or reserved sector
+    if (entry >= RAOS_FAT16_RESERVED) {
+        return -EIO;
+    }
+
+    // Ignored sector, or a pointer back into the reserved clusters
+    if (entry < 2) {
+        return -EIO;
+    }
+
+    return entry;
+}
+
+
 /**
  * @brief Get the cluster position for offset.
  * 
@@ -454,53 +490,23 @@ out:
  * @return int cluster position number; -EIO: error; -ENOMEM: out of memory
  */
 static int fat16_get_cluster_for_offset(struct disk* disk, int start_cluster, int offset) {
-    int res = 0;
-
     struct fat_private *private = disk->fs_private;
     int size_of_cluster_bytes = private->header.primary_header.sectors_per_cluster * disk->sector_size;
     
     int cluster_pos = start_cluster;
     int nclusters = offset / size_of_cluster_bytes;
-    for (int i = 0; i < nclusters; i++) {
-        // FAT table entry bytes for cluster.
-        int entry = fat16_get_fat_entry(disk, cluster_pos);
-        // Last entry of a file
-        if (entry == 0xFF8 || entry == 0xFFF) {
-            res = -EIO;
-            goto out;
-        }
-
-        // bad sector 
-        if (entry == RAOS_FAT16_BAD_SECTOR) {
-            res = -EIO;
-            goto out;
-        }
-
-        // reserved sector
-        if (entry == 0xFF0 || entry == 0xFF6) {
-            res = -EIO;
-            goto out;
-        }
-
-        // Ignored sector
-        if (entry == 0x00) {
-            res = -EIO;
-            goto out;
-        }
-
-        // next cluster position
-        cluster_pos = entry;
+    for (int i = 0; i < nclusters && cluster_pos >= 0; i++) {
+        cluster_pos = fat16_get_next_cluster(disk, cluster_pos);
     }
 
-    res = cluster_pos;
-out:
-    return res;
+    return cluster_pos;
 }
 
 
 /**
  * @brief Read items of the directory from disk, started at (start_cluster + offset), returned at 'out' pointer.
- *        We wil read cluster by cluster until we reach the total bytes.
+ *        We wil read cluster by cluster until we reach the total bytes, walking the FAT chain once
+ *        with constant stack use.
  * 
  * @param disk 
  * @param start_cluster 
@@ -514,35 +520,47 @@ static int fat16_read_items_of_directory(struct disk* disk, int start_cluster, i
     struct fat_private *private = disk->fs_private;
     struct disk_stream *stream = private->cluster_read_stream;
 
-    // the first cluster position
-    int cluster_pos = fat16_get_cluster_for_offset(disk, start_cluster, offset);
-    if (cluster_pos < 0) {
-        res = cluster_pos;
+    if (offset < 0 || total < 0) {
+        res = -EINVARG;
         goto out;
     }
 
+    // the first cluster position
+    int cluster_pos = fat16_get_cluster_for_offset(disk, start_cluster, offset);
     int size_of_cluster_bytes = private->header.primary_header.sectors_per_cluster * disk->sector_size;
+    // only the first cluster is read from its middle.
     int offset_from_cluster_pos = offset % size_of_cluster_bytes;
 
-    int starting_sector = private->root_directory.end_sector_pos + ((start_cluster - 2) * private->header.primary_header.sectors_per_cluster);
-    // start position in bytes.
-    int starting_pos = (starting_sector * disk->sector_size) + offset_from_cluster_pos;
-    int total_to_read = total > size_of_cluster_bytes ? size_of_cluster_bytes : total;
-    
-    res = diskstreamer_seek(stream, starting_pos);
-    if (res != RAOS_ALL_OK) {
-        goto out;
-    }
+    while (total > 0) {
+        if (cluster_pos < 2) {
+            res = cluster_pos < 0 ? cluster_pos : -EIO;
+            goto out;
+        }
 
-    res = diskstreamer_read(stream, out, total_to_read);
-    if (res != RAOS_ALL_OK) {
-        goto out;
-    }
+        int starting_sector = private->root_directory.end_sector_pos + ((cluster_pos - 2) * private->header.primary_header.sectors_per_cluster);
+        // start position in bytes.
+        int starting_pos = (starting_sector * disk->sector_size) + offset_from_cluster_pos;
+        int total_to_read = size_of_cluster_bytes - offset_from_cluster_pos;
+        if (total_to_read > total) {
+            total_to_read = total;
+        }
+
+        res = diskstreamer_seek(stream, starting_pos);
+        if (res != RAOS_ALL_OK) {
+            goto out;
+        }
+
+        res = diskstreamer_read(stream, out, total_to_read);
+        if (res != RAOS_ALL_OK) {
+            goto out;
+        }
 
-    total -= total_to_read;
-    if (total > 0) {
-        // recursivly read the next cluster.
-        res = fat16_read_items_of_directory(disk, start_cluster, offset + total_to_read, total, out + total_to_read);
+        out += total_to_read;
+        total -= total_to_read;
+        offset_from_cluster_pos = 0;
+        if (total > 0) {
+            cluster_pos = fat16_get_next_cluster(disk, cluster_pos);
+        }
     }
 
 out:
@@ -756,7 +774,100 @@ err_out:
 
 
 /**
- * @brief Read size * nmemb bytes from the desc file descriptor. 
+ * @brief Read the clusters of a file in a byte range into the block cache,
+ *        without waiting for them. Adjacent clusters go out as one read.
+ * 
+ * @param disk 
+ * @param item the file.
+ * @param start first byte, at a cluster boundary.
+ * @param end 
+ */
+static void fat16_read_ahead_range(struct disk* disk, struct fat_directory_item* item, uint32_t start, uint32_t end) {
+    struct fat_private *private = disk->fs_private;
+    int sectors_per_cluster = private->header.primary_header.sectors_per_cluster;
+    uint32_t size_of_cluster_bytes = sectors_per_cluster * disk->sector_size;
+
+    int cluster_pos = fat16_get_cluster_for_offset(disk, fat16_get_first_cluster_for_directory_item(item), start);
+    unsigned int run_lba = 0;
+    int run_total = 0;
+    for (uint32_t pos = start; pos < end && cluster_pos >= 2; pos += size_of_cluster_bytes) {
+        unsigned int lba = private->root_directory.end_sector_pos + ((cluster_pos - 2) * sectors_per_cluster);
+        if (run_total && lba != run_lba + run_total) {
+            disk_readahead(disk, run_lba, run_total);
+            run_total = 0;
+        }
+
+        if (!run_total) {
+            run_lba = lba;
+        }
+        run_total += sectors_per_cluster;
+
+        if (pos + size_of_cluster_bytes < end) {
+            cluster_pos = fat16_get_next_cluster(disk, cluster_pos);
+        }
+    }
+
+    if (run_total) {
+        disk_readahead(disk, run_lba, run_total);
+    }
+}
+
+
+/**
+ * @brief Adapt the readahead window of a file to a read of [offset, end).
+ *        Sequential reads double the window up to RAOS_READAHEAD_MAX_BYTES,
+ *        a random one drops it. The next part of the window is read once
+ *        the reader has used up half of it.
+ * 
+ * @param disk 
+ * @param desc 
+ * @param offset 
+ * @param end 
+ */
+static void fat16_readahead(struct disk* disk, struct fat_file_descriptor* desc, uint32_t offset, uint32_t end) {
+    struct fat_directory_item* item = desc->item->item;
+    if (desc->item->type != FAT_ITEM_TYPE_FILE) {
+        return;
+    }
+
+    bool sequential = offset == desc->ra_next;
+    desc->ra_next = end;
+    if (!sequential) {
+        desc->ra_window = 0;
+        desc->ra_end = 0;
+        return;
+    }
+
+    struct fat_private *private = disk->fs_private;
+    uint32_t size_of_cluster_bytes = private->header.primary_header.sectors_per_cluster * disk->sector_size;
+    if (!desc->ra_window) {
+        desc->ra_window = size_of_cluster_bytes;
+    } else if (desc->ra_window < RAOS_READAHEAD_MAX_BYTES) {
+        desc->ra_window *= 2;
+        if (desc->ra_window > RAOS_READAHEAD_MAX_BYTES) {
+            desc->ra_window = RAOS_READAHEAD_MAX_BYTES;
+        }
+    }
+
+    uint32_t limit = end + desc->ra_window;
+    if (limit > item->filesize) {
+        limit = item->filesize;
+    }
+
+    if (end >= limit || desc->ra_end >= limit || desc->ra_end >= end + desc->ra_window / 2) {
+        return;
+    }
+
+    uint32_t start = desc->ra_end > end ? desc->ra_end : end;
+    start -= start % size_of_cluster_bytes;
+    fat16_read_ahead_range(disk, item, start, limit);
+    desc->ra_end = limit;
+}
+
+
+/**
+ * @brief Read size * nmemb bytes from the desc file descriptor at its pos,
+ *        and move pos past them, so sequential reads need no fseek.
  * 
  * @param disk disk to read from.
  * @param desc file descriptor to read.
@@ -783,6 +894,8 @@ int fat16_read(struct disk* disk, void* desc, uint32_t size, uint32_t nmemb, cha
         offset += size;
     };
 
+    fat16_readahead(disk, file_descriptor, file_descriptor->pos, offset);
+    file_descriptor->pos = offset;
     res = nmemb;
 
 out:
@@ -7,12 +7,16 @@
 #include "../disk/disk.h"
 #include "../string/string.h"
 #include "../status.h"
+#include "../lock/spinlock.h"
 #include "fat/fat16.h"
 
 
 struct filesystem* filesystems[RAOS_MAX_FILESYSTEMS];
 struct file_descriptor* filedescriptors[RAOS_MAX_FILE_DESCRIPTORS];
 
+// Guards the filedescriptors slots.
+static struct spinlock filedescriptors_lock = SPINLOCK_INIT("filedescriptors");
+
 extern void print(const char *str);
 
 
@@ -49,29 +53,70 @@ static void fs_static_load() {
  * @return int 0 if success, otherwise return error code.
  */
 static int file_new_descriptor(struct file_descriptor** desc_out) {
+    // Allocate outside of the lock, the heap has its own.
+    struct file_descriptor* desc = kzalloc(sizeof(struct file_descriptor));
+    if (!desc) {
+        return -ENOMEM;
+    }
+
     int res = -ENOMEM;
+    uint32_t flags = spin_lock_irqsave(&filedescriptors_lock);
     for (int i = 0; i < RAOS_MAX_FILE_DESCRIPTORS; ++i) {
         if (filedescriptors[i] == 0) {
-            struct file_descriptor* desc = kzalloc(sizeof(struct file_descriptor));
             desc->index = i + 1;  // descriptor start at 1
+            desc->refcount = 1;
             filedescriptors[i] = desc;
             *desc_out = desc;
             res = 0;
             break;
         }
     }
+    spin_unlock_irqrestore(&filedescriptors_lock, flags);
+
+    if (res < 0) {
+        kfree(desc);
+    }
 
     return res;
 }
 
 
-// Get the file descriptor by index.
+// Get the file descriptor by index, with a reference file_put_descriptor()
+// gives back. An fclose() meanwhile leaves it open until then.
 static struct file_descriptor* file_get_descriptor(int fd) {
     if (fd <= 0 || fd >= RAOS_MAX_FILE_DESCRIPTORS) {
         return 0;
     }
 
-    return filedescriptors[fd - 1];  // descriptor start at 1
+    uint32_t flags = spin_lock_irqsave(&filedescriptors_lock);
+    struct file_descriptor* desc = filedescriptors[fd - 1];  // descriptor start at 1
+    if (desc) {
+        desc->refcount++;
+    }
+    spin_unlock_irqrestore(&filedescriptors_lock, flags);
+
+    return desc;
+}
+
+
+/**
+ * @brief Drop a reference, the last one closes the file and frees the
+ *        descriptor.
+ *
+ * @param desc
+ * @return int the result of the close, 0 if it was not the last reference
+ */
+static int file_put_descriptor(struct file_descriptor* desc) {
+    uint32_t flags = spin_lock_irqsave(&filedescriptors_lock);
+    bool     last  = --desc->refcount == 0;
+    spin_unlock_irqrestore(&filedescriptors_lock, flags);
+    if (!last) {
+        return 0;
+    }
+
+    int res = desc->filesystem->close(desc->private_);
+    kfree(desc);
+    return res;
 }
 
 
@@ -257,6 +302,7 @@ int fread(void *ptr, uint32_t size, uint32_t nmemb, int fd) {
 
     // in this case, private_ is the file_descriptor struct.
     res = desc->filesystem->read(desc->disk, desc->private_, size, nmemb, (char *)ptr);
+    file_put_descriptor(desc);
 
 out:
     return res;
@@ -282,6 +328,7 @@ int fseek(int fd, int offset, FILE_SEEK_MODE whence) {
 
     // This will change the file_descriptor's pos member that is the offset of content.
     res = desc->filesystem->seek(desc->private_, offset, whence);
+    file_put_descriptor(desc);
 
 out:
     return res;
@@ -299,6 +346,7 @@ int fstat(int fd, struct file_stat *stat) {
     } 
 
     res = descriptor->filesystem->stat(descriptor->disk,descriptor->private_, stat);
+    file_put_descriptor(descriptor);
     
 out:
     return res;
@@ -307,31 +355,27 @@ out:
 
 
 /**
- * @brief Free file descriptor in global filedescriptors array.
+ * @brief Free the slot of fd in global filedescriptors array. The file is
+ *        closed once the last caller still using it is done.
  * 
- * @param fdesc 
+ * @param fd 
+ * @return int 
  */
-static void file_free_descriptor(struct file_descriptor* fdesc) {
-    filedescriptors[fdesc->index - 1] = 0x00;
-    kfree(fdesc);
-}
-
-
 int fclose(int fd) {
-    int res = 0;
-
-    struct file_descriptor* descriptor = file_get_descriptor(fd);
-    if (!descriptor) {
-        res = -EIO;
-        goto out;
+    if (fd <= 0 || fd >= RAOS_MAX_FILE_DESCRIPTORS) {
+        return -EIO;
     }
 
-    res = descriptor->filesystem->close(descriptor->private_);
-    if (res == RAOS_ALL_OK) {
-        file_free_descriptor(descriptor);
+    uint32_t flags = spin_lock_irqsave(&filedescriptors_lock);
+    struct file_descriptor* descriptor = filedescriptors[fd - 1];
+    filedescriptors[fd - 1] = 0x00;
+    spin_unlock_irqrestore(&filedescriptors_lock, flags);
+
+    if (!descriptor) {
+        return -EIO;
     }
 
-out:
-    return res;
+    // Drop the reference of the slot.
+    return file_put_descriptor(descriptor);
 }
 
@@ -62,6 +62,9 @@ struct filesystem {
 
 struct file_descriptor {
     int index;
+    // The slot's reference and one per caller using it, under the lock of
+    // the slots. The last one closes the file.
+    int refcount;
     struct filesystem* filesystem;
 
     // for filesystem downstream process.
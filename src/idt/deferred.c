@@ -0,0 +1,71 @@
+#include "deferred.h"
+#include "../smp/smp.h"
+#include "../status.h"
+#include "idt.h"
+
+
+// One ring per CPU, work runs on the CPU that took the interrupt.
+static struct deferred_queue deferred_queues[RAOS_MAX_CPUS];
+
+
+/**
+ * @brief Queue work to run after the interrupt returns. Must be called with
+ *        interrupts disabled, e.g. from an interrupt callback.
+ *
+ * @param function
+ * @param data passed to function.
+ * @return int -ENOMEM when the queue is full, the work is dropped.
+ */
+int deferred_work_queue(DEFERRED_WORK_FUNCTION function, void* data) {
+    struct deferred_queue* queue = &deferred_queues[cpu_current()->id];
+
+    uint32_t tail = queue->tail;
+    if (tail - queue->head == RAOS_DEFERRED_WORK_QUEUE_SIZE) {
+        queue->dropped++;
+        return -ENOMEM;
+    }
+
+    struct deferred_work* work =
+        &queue->items[tail % RAOS_DEFERRED_WORK_QUEUE_SIZE];
+    work->function = function;
+    work->data     = data;
+
+    // Publish the item only after it is written.
+    __asm__ volatile("" ::: "memory");
+    queue->tail = tail + 1;
+    return 0;
+}
+
+
+/**
+ * @brief Run the queued work with interrupts enabled. Called with
+ *        interrupts disabled on interrupt exit; returns with them disabled.
+ *        Interrupts arriving meanwhile only queue, the outer run drains them.
+ *
+ */
+void deferred_work_run() {
+    struct deferred_queue* queue = &deferred_queues[cpu_current()->id];
+    if (queue->draining || queue->head == queue->tail) {
+        return;
+    }
+
+    queue->draining = true;
+    while (queue->head != queue->tail) {
+        enable_interrupts();
+        while (queue->head != queue->tail) {
+            struct deferred_work work =
+                queue->items[queue->head % RAOS_DEFERRED_WORK_QUEUE_SIZE];
+            queue->head++;
+            work.function(work.data);
+        }
+        // Re-check with interrupts off, nothing can slip in after this.
+        disable_interrupts();
+    }
+    queue->draining = false;
+}
+
+
+// True while this CPU runs queued work, interrupts must be off.
+bool deferred_work_draining() {
+    return deferred_queues[cpu_current()->id].draining;
+}
@@ -0,0 +1,34 @@
+#ifndef _DEFERRED_H
+#define _DEFERRED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../config.h"
+
+typedef void (*DEFERRED_WORK_FUNCTION)(void* data);
+
+struct deferred_work {
+    DEFERRED_WORK_FUNCTION function;
+    void*                  data;
+};
+
+// Per-CPU ring of work that interrupt handlers hand over to run later with
+// interrupts enabled. The producer is interrupt context (gates clear IF, so
+// handlers never nest) and the consumer is deferred_work_run(), hence one
+// writer per index and no lock.
+struct deferred_queue {
+    struct deferred_work items[RAOS_DEFERRED_WORK_QUEUE_SIZE];
+
+    volatile uint32_t head;  // next item to run, written by the consumer
+    volatile uint32_t tail;  // next free slot, written by the producer
+
+    uint32_t dropped;  // queue was full
+    bool     draining;
+};
+
+int  deferred_work_queue(DEFERRED_WORK_FUNCTION function, void* data);
+void deferred_work_run();
+bool deferred_work_draining();
+
+#endif
@@ -1,13 +1,14 @@
 section .asm
 
-extern int21h_handler
-extern no_interrupt_handler
+extern interrupt_handler
 
 global idt_load
-global int21h
-global no_interrupt
 global enable_interrupts
 global disable_interrupts
+global interrupt_pointer_table
+
+; Keep in sync with RAOS_TOTAL_INTERRUPTS in config.h
+RAOS_TOTAL_INTERRUPTS equ 256
 
 
 enable_interrupts:
@@ -32,24 +33,54 @@ idt_load:
     pop ebp
     ret
 
+
+; One stub per vector. The CPU pushes an error code itself for vectors
+; 8, 10-14, 17, 21, 29 and 30; every other stub pushes a dummy 0, so all
+; vectors share one struct interrupt_frame layout (see idt.h).
+; The gate type is an interrupt gate, so IF is already clear on entry and
+; restored by iret, no cli/sti needed.
+%macro interrupt 1
+    global int%1
+    int%1:
+    %if %1 == 8 || (%1 >= 10 && %1 <= 14) || %1 == 17 || %1 == 21 || %1 == 29 || %1 == 30
+    %else
+        push dword 0    ; dummy error code
+    %endif
+        push dword %1   ; vector number
+        jmp interrupt_common
+%endmacro
+
+%assign i 0
+%rep RAOS_TOTAL_INTERRUPTS
+    interrupt i
+%assign i i+1
+%endrep
+
+
 ; https://faydoc.tripod.com/cpu/pushad.htm
-int21h:
-    cli      ; clear interrupts
-    pushad   ; Push EAX, ECX, EDX, EBX, original ESP, EBP, ESI, and EDI
+interrupt_common:
+    pushad              ; Push EAX, ECX, EDX, EBX, original ESP, EBP, ESI, and EDI
+    cld
 
-    call int21h_handler
+    push esp            ; struct interrupt_frame*
+    call interrupt_handler
+    add esp, 4
 
     popad
-    sti      ; enable interrupts 
+    add esp, 8          ; drop the vector number and the error code
     iret
 
 
-no_interrupt:
-    cli      ; clear interrupts
-    pushad   ; Push EAX, ECX, EDX, EBX, original ESP, EBP, ESI, and EDI
+section .data
 
-    call no_interrupt_handler
+; void* interrupt_pointer_table[RAOS_TOTAL_INTERRUPTS], the stub of each vector.
+interrupt_pointer_table:
+%macro interrupt_array_entry 1
+    dd int%1
+%endmacro
 
-    popad
-    sti      ; enable interrupts 
-    iret
\ No newline at end of file
+%assign i 0
+%rep RAOS_TOTAL_INTERRUPTS
+    interrupt_array_entry i
+%assign i i+1
+%endrep
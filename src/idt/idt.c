@@ -1,34 +1,318 @@
 #include "idt.h"
 #include "../config.h"
+#include "../cpu/cpu.h"
 #include "../io/io.h"
+#include "../isr80h/isr80h.h"
 #include "../kernel.h"
 #include "../memory/memory.h"
+#include "../smp/smp.h"
+#include "../status.h"
+#include "../string/string.h"
+#include "../task/process.h"
+#include "../task/task.h"
+#include "deferred.h"
+#include "irq.h"
+#include "pic.h"
 
 
 
 struct idt_desc  idt_descriptors[RAOS_TOTAL_INTERRUPTS];
 struct idtr_desc idtr_descriptors;
 
+// The registered C handler of each vector, 0 if none.
+static INTERRUPT_CALLBACK_FUNCTION interrupt_callbacks[RAOS_TOTAL_INTERRUPTS];
+
+// Per-vector counters, updated by interrupt_handler.
+// One set per CPU, so the handlers of all CPUs count without atomics.
+static struct interrupt_stats interrupt_stats[RAOS_MAX_CPUS][RAOS_TOTAL_INTERRUPTS];
+
+// Stub entry of each vector, generated in idt.asm.
+extern void* interrupt_pointer_table[RAOS_TOTAL_INTERRUPTS];
 
 extern void idt_load(struct idtr_desc* ptr);
-extern void int21h();
-extern void no_interrupt();
 
 
-// For IDT test
-// void idt_zero() {
-//     print("Divide by zero error\n");
-// }
+// Present 32-bit interrupt gates, DPL 0 and DPL 3.
+#define IDT_GATE_KERNEL 0x8E
+#define IDT_GATE_USER 0xEE
+
+#define IDT_TOTAL_EXCEPTIONS 32
+#define IDT_EXCEPTION_PAGE_FAULT 14
+
+// https://wiki.osdev.org/Exceptions
+static const char* exception_messages[IDT_TOTAL_EXCEPTIONS] = {
+    "Divide by zero",
+    "Debug",
+    "Non-maskable interrupt",
+    "Breakpoint",
+    "Overflow",
+    "Bound range exceeded",
+    "Invalid opcode",
+    "Device not available",
+    "Double fault",
+    "Coprocessor segment overrun",
+    "Invalid TSS",
+    "Segment not present",
+    "Stack-segment fault",
+    "General protection fault",
+    "Page fault",
+    "Reserved",
+    "x87 floating-point exception",
+    "Alignment check",
+    "Machine check",
+    "SIMD floating-point exception",
+    "Virtualization exception",
+    "Control protection exception",
+    "Reserved",
+    "Reserved",
+    "Reserved",
+    "Reserved",
+    "Reserved",
+    "Reserved",
+    "Hypervisor injection exception",
+    "VMM communication exception",
+    "Security exception",
+    "Reserved",
+};
+
+
+static bool idt_frame_from_user(struct interrupt_frame* frame) {
+    return (frame->cs & 0x03) == 0x03;
+}
+
+
+static void idt_print_field(const char* name, uint32_t value) {
+    char buf[16];
+    print(name);
+    print("=0x");
+    print(uitoa(value, buf, 16));
+    print(" ");
+}
+
+
+/**
+ * @brief Report the faulting frame. A fault in user land only kills the
+ *        process, a fault in the kernel is fatal.
+ *
+ * @param frame
+ */
+static void idt_handle_exception(struct interrupt_frame* frame) {
+    print("\nException: ");
+    print(exception_messages[frame->vector]);
+    print("\n");
+
+    idt_print_field("err", frame->error_code);
+    idt_print_field("eip", frame->ip);
+    idt_print_field("cs", frame->cs);
+    idt_print_field("eflags", frame->flags);
+    if (frame->vector == IDT_EXCEPTION_PAGE_FAULT) {
+        idt_print_field("cr2", cpu_read_cr2());
+    }
+    print("\n");
+    idt_print_field("eax", frame->eax);
+    idt_print_field("ebx", frame->ebx);
+    idt_print_field("ecx", frame->ecx);
+    idt_print_field("edx", frame->edx);
+    print("\n");
+    idt_print_field("esi", frame->esi);
+    idt_print_field("edi", frame->edi);
+    idt_print_field("ebp", frame->ebp);
+    if (idt_frame_from_user(frame)) {
+        idt_print_field("esp", frame->esp);
+        idt_print_field("ss", frame->ss);
+    }
+    print("\n");
+
+    if (!idt_frame_from_user(frame) || !task_current()) {
+        panic("Kernel exception, system halted.\n");
+    }
+
+    process_terminate(task_current()->process);
+    task_next();
+}
 
 
-void int21h_handler() {
+static void keyboard_pressed_work(void* data) {
     print("Keyboard pressed.\n");
-    outb(0x20, 0x20);
 }
 
 
-void no_interrupt_handler() {
-    outb(0x20, 0x20);  // tell PIC we handled the interrupt.
+// Only queue the slow VGA output, it runs after the interrupt returns.
+void int21h_handler(struct interrupt_frame* frame) {
+    deferred_work_queue(keyboard_pressed_work, 0);
+}
+
+
+/**
+ * @brief Common C entry of every interrupt stub in idt.asm.
+ *
+ * @param frame registers pushed by the CPU and the stub.
+ */
+void interrupt_handler(struct interrupt_frame* frame) {
+    int interrupt = frame->vector;
+    if (irq_is_spurious(interrupt)) {
+        return;
+    }
+
+    interrupt_stats[cpu_current()->id][interrupt].count++;
+
+    // EOI first, a callback like the scheduler tick may never return here.
+    // IF stays clear until iret, so the line can not fire again meanwhile.
+    irq_send_eoi(interrupt);
+
+    INTERRUPT_CALLBACK_FUNCTION callback = interrupt_callbacks[interrupt];
+    if (!callback) {
+        return;
+    }
+
+    uint64_t start = cpu_rdtsc();
+
+    // A system call runs in the context of its task, it may sleep and is
+    // preempted like user land. Anything else is interrupt context.
+    bool syscall = interrupt == ISR80H_INTERRUPT;
+    if (!syscall) {
+        cpu_current()->irq_depth++;
+    }
+
+    bool from_user = idt_frame_from_user(frame);
+    if (from_user) {
+        // The kernel is mapped in every directory, so it runs under the
+        // task's and only needs its data segments.
+        if (task_get_switch_mode() == TASK_SWITCH_RELOAD_CR3) {
+            kernel_page();
+        } else {
+            kernel_registers();
+        }
+        task_current_save_stat(frame);
+    }
+
+    callback(frame);
+
+    // Not reached when the callback switched to another task for good. A
+    // preempted one may come back on another CPU, count it there.
+    struct interrupt_stats* stats  = &interrupt_stats[cpu_current()->id][interrupt];
+    uint32_t                cycles = (uint32_t)(cpu_rdtsc() - start);
+    if (stats->timed == 0 || cycles < stats->min_cycles) {
+        stats->min_cycles = cycles;
+    }
+    if (cycles > stats->max_cycles) {
+        stats->max_cycles = cycles;
+    }
+    stats->total_cycles += cycles;
+    stats->timed++;
+
+    // Bottom halves of the handlers, with interrupts back on.
+    deferred_work_run();
+
+    // Maybe on another CPU than on entry, the task was preempted.
+    if (!syscall) {
+        cpu_current()->irq_depth--;
+    }
+
+    if (from_user) {
+        // A thread of a terminated process exits instead of going back.
+        if (task_current()->process->dying) {
+            process_thread_exit(task_current(), 0);
+        }
+        task_page();
+    }
+}
+
+
+/**
+ * @brief True in an interrupt handler or in deferred work, where nothing may
+ *        sleep. A system call is no interrupt context.
+ *
+ * @return bool
+ */
+bool idt_in_interrupt() {
+    uint32_t    flags = cpu_irq_save();
+    struct cpu* cpu   = cpu_current();
+    bool        res   = cpu->irq_depth > 0 || deferred_work_draining();
+    cpu_irq_restore(flags);
+    return res;
+}
+
+
+/**
+ * @brief Called by the handler of an interrupt from kernel mode: true when
+ *        it interrupted a task in a system call or kernel task, not another
+ *        handler, so the task may be switched away from like in user land.
+ *
+ * @return bool
+ */
+bool idt_preemptible() {
+    struct cpu* cpu = cpu_current();
+    return cpu->running_task && cpu->irq_depth == 1 && !deferred_work_draining();
+}
+
+
+/**
+ * @brief The counters of a vector summed over all CPUs.
+ *
+ * @param interrupt vector number.
+ * @param sum filled in
+ * @return int
+ */
+int idt_get_stats(int interrupt, struct interrupt_stats* sum) {
+    if (interrupt < 0 || interrupt >= RAOS_TOTAL_INTERRUPTS) {
+        return -EINVARG;
+    }
+
+    memset(sum, 0, sizeof(struct interrupt_stats));
+    for (int i = 0; i < smp_total_cpus(); ++i) {
+        struct interrupt_stats* stats = &interrupt_stats[i][interrupt];
+        sum->count += stats->count;
+        if (!stats->timed) {
+            continue;
+        }
+
+        if (!sum->timed || stats->min_cycles < sum->min_cycles) {
+            sum->min_cycles = stats->min_cycles;
+        }
+        if (stats->max_cycles > sum->max_cycles) {
+            sum->max_cycles = stats->max_cycles;
+        }
+        sum->total_cycles += stats->total_cycles;
+        sum->timed += stats->timed;
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief Print count and min/avg/max handler cycles of every vector that
+ *        fired at least once.
+ *
+ */
+void idt_print_stats() {
+    char buf[16];
+    print("vector count min/avg/max cycles\n");
+    for (int i = 0; i < RAOS_TOTAL_INTERRUPTS; ++i) {
+        struct interrupt_stats stats;
+        idt_get_stats(i, &stats);
+        if (!stats.count) {
+            continue;
+        }
+
+        uint32_t avg = 0;
+        if (stats.timed) {
+            avg = cpu_div_u64_u32(stats.total_cycles, stats.timed);
+        }
+
+        print("0x");
+        print(uitoa(i, buf, 16));
+        print(" ");
+        print(uitoa(stats.count, buf, 10));
+        print(" ");
+        print(uitoa(stats.min_cycles, buf, 10));
+        print("/");
+        print(uitoa(avg, buf, 10));
+        print("/");
+        print(uitoa(stats.max_cycles, buf, 10));
+        print("\n");
+    }
 }
 
 
@@ -41,28 +325,65 @@ void idt_set(int interrupt_no, void* address) {
     // https://wiki.osdev.org/Interrupt_Descriptor_Table
     // 47   | 46  45   | 44	| 43    40
     // P(1)    DPL(1/0)   0   Gate type
-    desc->type_attr = 0xEE;
+    // Only the system call may be raised with int from user land, any
+    // other vector faults with #GP there: a fake timer tick would advance
+    // kernel time, a fake exception would misread the error code.
+    desc->type_attr =
+        interrupt_no == ISR80H_INTERRUPT ? IDT_GATE_USER : IDT_GATE_KERNEL;
     desc->offset_2  = (uint32_t)address >> 16;
 }
 
 
+/**
+ * @brief Register the C handler of a vector, drivers do not need to write
+ *        any assembly. The IRQ EOI is sent by interrupt_handler.
+ *
+ * @param interrupt vector number.
+ * @param callback
+ * @return int
+ */
+int idt_register_interrupt_callback(int                         interrupt,
+                                    INTERRUPT_CALLBACK_FUNCTION callback) {
+    if (interrupt < 0 || interrupt >= RAOS_TOTAL_INTERRUPTS) {
+        return -EINVARG;
+    }
+
+    interrupt_callbacks[interrupt] = callback;
+    return 0;
+}
+
+
+// Application processors share the IDT.
+void idt_ap_init() {
+    idt_load(&idtr_descriptors);
+}
+
+
 void idt_init() {
     memset(idt_descriptors, 0, sizeof(idt_descriptors));
+    memset(interrupt_stats, 0, sizeof(interrupt_stats));
     idtr_descriptors.limit = sizeof(idt_descriptors) - 1;
     idtr_descriptors.base  = (uint32_t)idt_descriptors;
 
-    // init all interrupt to a default action.
+    // Every vector goes through its own stub into interrupt_handler.
     for (int i = 0; i < RAOS_TOTAL_INTERRUPTS; ++i) {
-        idt_set(i, no_interrupt);
+        idt_set(i, interrupt_pointer_table[i]);
     }
 
-    // For IDT test. regist the handler to div 0.
-    // idt_set(0, idt_zero);
-    idt_set(0x21, int21h);
+    for (int i = 0; i < IDT_TOTAL_EXCEPTIONS; ++i) {
+        idt_register_interrupt_callback(i, idt_handle_exception);
+    }
+
+    // Remap the PICs behind the exceptions before any IRQ can arrive.
+    pic_init();
+
+    idt_register_interrupt_callback(IRQ_VECTOR_BASE + IRQ_KEYBOARD,
+                                    int21h_handler);
+    irq_unmask(IRQ_KEYBOARD);
 
     // By using time IRQ, you constantlly switch function between processes,
     // and swap the task related registers, it gives you the illusion of
-    // multitasking running. idt_set(0x20, function); idt_set(0x20, int21h);
+    // multitasking running. Registered by timer_init().
 
     idt_load(&idtr_descriptors);
-}
\ No newline at end of file
+}
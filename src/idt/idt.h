@@ -1,6 +1,7 @@
 #ifndef _IDT_H
 #define _IDT_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 
@@ -28,15 +29,37 @@ struct interrupt_frame {
     uint32_t edx;
     uint32_t ecx;
     uint32_t eax;
+    uint32_t vector;      // pushed by the stub in idt.asm
+    uint32_t error_code;  // pushed by the CPU, or a dummy 0 by the stub
     uint32_t ip;
     uint32_t cs;
     uint32_t flags;
-    uint32_t esp;
+    uint32_t esp;  // esp and ss are only pushed when entered from user land
     uint32_t ss;
 } __attribute__((packed));
 
 
+// Per-vector load, handler time is measured in rdtsc cycles.
+struct interrupt_stats {
+    uint32_t count;
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint64_t total_cycles;  // of the handlers that returned
+    uint32_t timed;         // number of samples in total_cycles
+};
+
+
+typedef void (*INTERRUPT_CALLBACK_FUNCTION)(struct interrupt_frame* frame);
+
+
 void idt_init();
+void idt_ap_init();
+int  idt_register_interrupt_callback(int                         interrupt,
+                                     INTERRUPT_CALLBACK_FUNCTION callback);
+int                     idt_get_stats(int interrupt, struct interrupt_stats* sum);
+bool                    idt_in_interrupt();
+bool                    idt_preemptible();
+void                    idt_print_stats();
 void enable_interrupts();
 void disable_interrupts();
 
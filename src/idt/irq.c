@@ -0,0 +1,93 @@
+#include "irq.h"
+#include "../apic/apic.h"
+
+
+// IRQs drivers asked for, re-applied when switching to the IOAPIC.
+static unsigned short irq_unmasked = 0;
+
+
+void irq_unmask(int irq) {
+    irq_unmasked |= 1 << irq;
+    if (apic_is_enabled()) {
+        ioapic_route_irq(irq, IRQ_VECTOR_BASE + irq);
+        return;
+    }
+
+    pic_unmask(irq);
+}
+
+
+void irq_mask(int irq) {
+    irq_unmasked &= ~(1 << irq);
+    if (apic_is_enabled()) {
+        ioapic_mask_irq(irq);
+        return;
+    }
+
+    pic_mask(irq);
+}
+
+
+/**
+ * @brief Hand the ISA IRQs over to the IOAPIC once apic_init() succeeded.
+ *        The 8259s are fully masked, the timer IRQ stays off because the
+ *        local APIC timer replaces the PIT.
+ *
+ */
+void irq_use_apic() {
+    for (int irq = 0; irq < IRQ_TOTAL; ++irq) {
+        pic_mask(irq);
+    }
+
+    irq_unmasked &= ~(1 << IRQ_TIMER);
+    for (int irq = 0; irq < IRQ_TOTAL; ++irq) {
+        if (irq_unmasked & (1 << irq)) {
+            ioapic_route_irq(irq, IRQ_VECTOR_BASE + irq);
+        }
+    }
+}
+
+
+static bool irq_is_vector(int interrupt) {
+    return interrupt >= IRQ_VECTOR_BASE
+           && interrupt < IRQ_VECTOR_BASE + IRQ_TOTAL;
+}
+
+
+static bool irq_is_ipi_vector(int interrupt) {
+    return interrupt == APIC_WAKEUP_VECTOR || interrupt == APIC_TLB_FLUSH_VECTOR;
+}
+
+
+bool irq_is_spurious(int interrupt) {
+    if (apic_is_enabled()) {
+        return interrupt == APIC_SPURIOUS_VECTOR;
+    }
+
+    return pic_is_spurious(interrupt);
+}
+
+
+/**
+ * @brief Acknowledge an IRQ vector, exceptions and software interrupts need
+ *        nothing.
+ *
+ * @param interrupt
+ */
+void irq_send_eoi(int interrupt) {
+    if (apic_is_enabled() && irq_is_ipi_vector(interrupt)) {
+        lapic_send_eoi();
+        return;
+    }
+
+    if (!irq_is_vector(interrupt)) {
+        return;
+    }
+
+    if (apic_is_enabled()) {
+        lapic_send_eoi();
+        return;
+    }
+
+    pic_send_eoi(interrupt);
+}
@@ -0,0 +1,25 @@
+#ifndef _IRQ_H
+#define _IRQ_H
+
+#include <stdbool.h>
+
+#include "pic.h"
+
+// ISA IRQs are delivered at the same vectors whether the 8259 PIC or the
+// IOAPIC is in use, so handlers do not care which one is active.
+#define IRQ_VECTOR_BASE PIC_MASTER_VECTOR_OFFSET
+#define IRQ_TOTAL PIC_TOTAL_IRQS
+
+#define IRQ_TIMER 0
+#define IRQ_KEYBOARD 1
+#define IRQ_ATA_PRIMARY 14
+#define IRQ_ATA_SECONDARY 15
+
+void irq_unmask(int irq);
+void irq_mask(int irq);
+void irq_use_apic();
+
+bool irq_is_spurious(int interrupt);
+void irq_send_eoi(int interrupt);
+
+#endif
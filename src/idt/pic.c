@@ -0,0 +1,112 @@
+#include "pic.h"
+#include "../io/io.h"
+
+
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA 0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA 0xA1
+
+#define PIC_EOI 0x20
+#define PIC_READ_ISR 0x0B
+
+#define PIC_ICW1_INIT 0b00010001  // b4=1: init ; b0=1: need 4th init step
+#define PIC_ICW4_8086 0b00000001  // b0=1: x86 mode, not AEOI
+
+#define PIC_CASCADE_IRQ 2
+
+
+/**
+ * @brief Remap both PICs behind the intel exceptions. The masks the BIOS left
+ *        are kept, so the same IRQs stay enabled.
+ *
+ */
+void pic_init() {
+    unsigned char master_mask = insb(PIC1_DATA);
+    unsigned char slave_mask  = insb(PIC2_DATA);
+
+    outb(PIC1_COMMAND, PIC_ICW1_INIT);
+    outb(PIC2_COMMAND, PIC_ICW1_INIT);
+
+    outb(PIC1_DATA, PIC_MASTER_VECTOR_OFFSET);  // ICW2: vector offset
+    outb(PIC2_DATA, PIC_SLAVE_VECTOR_OFFSET);
+
+    outb(PIC1_DATA, 1 << PIC_CASCADE_IRQ);  // ICW3: slave sits on IRQ2
+    outb(PIC2_DATA, PIC_CASCADE_IRQ);       // ICW3: slave cascade identity
+
+    outb(PIC1_DATA, PIC_ICW4_8086);
+    outb(PIC2_DATA, PIC_ICW4_8086);
+
+    outb(PIC1_DATA, master_mask);
+    outb(PIC2_DATA, slave_mask);
+}
+
+
+void pic_mask(int irq) {
+    unsigned short port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, insb(port) | (1 << (irq % 8)));
+}
+
+
+void pic_unmask(int irq) {
+    unsigned short port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, insb(port) & ~(1 << (irq % 8)));
+    if (irq >= 8) {
+        pic_unmask(PIC_CASCADE_IRQ);
+    }
+}
+
+
+bool pic_is_irq_vector(int interrupt) {
+    return interrupt >= PIC_MASTER_VECTOR_OFFSET
+           && interrupt < PIC_MASTER_VECTOR_OFFSET + PIC_TOTAL_IRQS;
+}
+
+
+static unsigned char pic_read_isr(unsigned short command_port) {
+    outb(command_port, PIC_READ_ISR);
+    return insb(command_port);
+}
+
+
+/**
+ * @brief IRQ7 and IRQ15 may be raised by the PIC when nothing is actually
+ *        in service (spurious). They must not get an EOI from their own PIC,
+ *        but a spurious IRQ15 still needs one for the cascade on the master.
+ *
+ * @param interrupt vector number.
+ * @return true the interrupt should be ignored.
+ */
+bool pic_is_spurious(int interrupt) {
+    if (interrupt == PIC_MASTER_VECTOR_OFFSET + 7) {
+        return !(pic_read_isr(PIC1_COMMAND) & 0x80);
+    }
+
+    if (interrupt == PIC_SLAVE_VECTOR_OFFSET + 7) {
+        if (!(pic_read_isr(PIC2_COMMAND) & 0x80)) {
+            outb(PIC1_COMMAND, PIC_EOI);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/**
+ * @brief Tell the PIC(s) that the interrupt is handled. IRQs from the slave
+ *        need the EOI on both chips.
+ *
+ * @param interrupt vector number, nothing is sent for non IRQ vectors.
+ */
+void pic_send_eoi(int interrupt) {
+    if (!pic_is_irq_vector(interrupt)) {
+        return;
+    }
+
+    if (interrupt >= PIC_SLAVE_VECTOR_OFFSET) {
+        outb(PIC2_COMMAND, PIC_EOI);
+    }
+
+    outb(PIC1_COMMAND, PIC_EOI);
+}
@@ -0,0 +1,21 @@
+#ifndef _PIC_H
+#define _PIC_H
+
+#include <stdbool.h>
+
+// https://wiki.osdev.org/8259_PIC
+// IRQ 0-7 on the master are remapped to 0x20-0x27, IRQ 8-15 on the slave to
+// 0x28-0x2F, just after the intel exceptions.
+#define PIC_MASTER_VECTOR_OFFSET 0x20
+#define PIC_SLAVE_VECTOR_OFFSET 0x28
+#define PIC_TOTAL_IRQS 16
+
+void pic_init();
+void pic_mask(int irq);
+void pic_unmask(int irq);
+
+bool pic_is_irq_vector(int interrupt);
+bool pic_is_spurious(int interrupt);
+void pic_send_eoi(int interrupt);
+
+#endif
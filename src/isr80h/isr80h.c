@@ -0,0 +1,81 @@
+#include "isr80h.h"
+#include "../config.h"
+#include "../idt/idt.h"
+#include "../kernel.h"
+#include "misc.h"
+
+
+static ISR80H_COMMAND isr80h_commands[RAOS_MAX_ISR80H_COMMANDS];
+
+
+void isr80h_register_command(int command_id, ISR80H_COMMAND command) {
+    if (command_id < 0 || command_id >= RAOS_MAX_ISR80H_COMMANDS) {
+        panic("isr80h_register_command(): command out of bounds\n");
+    }
+
+    if (isr80h_commands[command_id]) {
+        panic("isr80h_register_command(): command already taken\n");
+    }
+
+    isr80h_commands[command_id] = command;
+}
+
+
+static void* isr80h_handle_command(int command, struct interrupt_frame* frame) {
+    if (command < 0 || command >= RAOS_MAX_ISR80H_COMMANDS) {
+        return 0;
+    }
+
+    ISR80H_COMMAND command_func = isr80h_commands[command];
+    if (!command_func) {
+        return 0;
+    }
+
+    return command_func(frame);
+}
+
+
+/**
+ * @brief int 0x80 callback. The current task points at the frame since
+ *        interrupt_handler, eax is restored from the frame by the stub.
+ *        Commands run with interrupts on, on the task's own kernel stack:
+ *        they may block, and the timer preempts them.
+ *
+ * @param frame
+ */
+static void isr80h_handler(struct interrupt_frame* frame) {
+    enable_interrupts();
+    frame->eax = (uint32_t)isr80h_handle_command(frame->eax, frame);
+    disable_interrupts();
+}
+
+
+static void isr80h_register_commands() {
+    isr80h_register_command(SYSTEM_COMMAND0_IRQ_STATS,
+                            isr80h_command0_irq_stats);
+    isr80h_register_command(SYSTEM_COMMAND1_SLEEP, isr80h_command1_sleep);
+    isr80h_register_command(SYSTEM_COMMAND2_SWITCH_STATS,
+                            isr80h_command2_switch_stats);
+    isr80h_register_command(SYSTEM_COMMAND3_THREAD_CREATE,
+                            isr80h_command3_thread_create);
+    isr80h_register_command(SYSTEM_COMMAND4_THREAD_JOIN,
+                            isr80h_command4_thread_join);
+    isr80h_register_command(SYSTEM_COMMAND5_THREAD_EXIT,
+                            isr80h_command5_thread_exit);
+    isr80h_register_command(SYSTEM_COMMAND6_FUTEX_WAIT,
+                            isr80h_command6_futex_wait);
+    isr80h_register_command(SYSTEM_COMMAND7_FUTEX_WAKE,
+                            isr80h_command7_futex_wake);
+    isr80h_register_command(SYSTEM_COMMAND8_DISK_STATS,
+                            isr80h_command8_disk_stats);
+    isr80h_register_command(SYSTEM_COMMAND10_LOCK_STATS,
+                            isr80h_command10_lock_stats);
+    isr80h_register_command(SYSTEM_COMMAND11_SET_AFFINITY,
+                            isr80h_command11_set_affinity);
+}
+
+
+void isr80h_init() {
+    isr80h_register_commands();
+    idt_register_interrupt_callback(ISR80H_INTERRUPT, isr80h_handler);
+}
@@ -0,0 +1,30 @@
+#ifndef _ISR80H_H
+#define _ISR80H_H
+
+struct interrupt_frame;
+
+#define ISR80H_INTERRUPT 0x80
+
+// User land puts the command number in eax, arguments on its stack, and
+// raises int 0x80. The result comes back in eax.
+enum SystemCommands {
+    SYSTEM_COMMAND0_IRQ_STATS,
+    SYSTEM_COMMAND1_SLEEP,
+    SYSTEM_COMMAND2_SWITCH_STATS,
+    SYSTEM_COMMAND3_THREAD_CREATE,
+    SYSTEM_COMMAND4_THREAD_JOIN,
+    SYSTEM_COMMAND5_THREAD_EXIT,
+    SYSTEM_COMMAND6_FUTEX_WAIT,
+    SYSTEM_COMMAND7_FUTEX_WAKE,
+    SYSTEM_COMMAND8_DISK_STATS,
+    SYSTEM_COMMAND9_UNUSED,  // was switch_mode, now RAOS_TASK_SWITCH_RELOAD_CR3
+    SYSTEM_COMMAND10_LOCK_STATS,
+    SYSTEM_COMMAND11_SET_AFFINITY,
+};
+
+typedef void* (*ISR80H_COMMAND)(struct interrupt_frame* frame);
+
+void isr80h_init();
+void isr80h_register_command(int command_id, ISR80H_COMMAND command);
+
+#endif
@@ -0,0 +1,105 @@
+#include "misc.h"
+#include "../disk/disk.h"
+#include "../idt/idt.h"
+#include "../lock/spinlock.h"
+#include "../task/futex.h"
+#include "../task/process.h"
+#include "../task/task.h"
+
+
+// Print the per-vector interrupt counters and handler cycles.
+void* isr80h_command0_irq_stats(struct interrupt_frame* frame) {
+    idt_print_stats();
+    return 0;
+}
+
+
+// sleep(ms), the task gives up the CPU until the timer wheel wakes it.
+void* isr80h_command1_sleep(struct interrupt_frame* frame) {
+    uint32_t ms = (uint32_t)task_get_stack_item(task_current(), 0);
+    task_sleep(ms);
+    return 0;
+}
+
+
+// Benchmark, cycles per task switch on each CPU.
+void* isr80h_command2_switch_stats(struct interrupt_frame* frame) {
+    task_print_switch_stats();
+    return 0;
+}
+
+
+// thread_create(entry, arg), the new thread id or a negative status.
+void* isr80h_command3_thread_create(struct interrupt_frame* frame) {
+    struct task* task  = task_current();
+    void*        entry = task_get_stack_item(task, 0);
+    void*        arg   = task_get_stack_item(task, 1);
+    return (void*)process_thread_create(task->process, entry, arg);
+}
+
+
+// thread_join(thread_id), the exit code of the thread or a negative status.
+void* isr80h_command4_thread_join(struct interrupt_frame* frame) {
+    struct task* task      = task_current();
+    int          thread_id = (int)task_get_stack_item(task, 0);
+    return (void*)process_thread_join(task->process, thread_id);
+}
+
+
+// thread_exit(exit_code), never returns to the calling thread.
+void* isr80h_command5_thread_exit(struct interrupt_frame* frame) {
+    struct task* task      = task_current();
+    uint32_t     exit_code = (uint32_t)task_get_stack_item(task, 0);
+    process_thread_exit(task, exit_code);
+    return 0;
+}
+
+
+// futex_wait(uaddr, expected), 0 once woken or a negative status.
+void* isr80h_command6_futex_wait(struct interrupt_frame* frame) {
+    struct task* task     = task_current();
+    void*        uaddr    = task_get_stack_item(task, 0);
+    uint32_t     expected = (uint32_t)task_get_stack_item(task, 1);
+    return (void*)futex_wait(task, uaddr, expected);
+}
+
+
+// futex_wake(uaddr, count), the number of tasks woken up.
+void* isr80h_command7_futex_wake(struct interrupt_frame* frame) {
+    struct task* task  = task_current();
+    void*        uaddr = task_get_stack_item(task, 0);
+    int          count = (int)task_get_stack_item(task, 1);
+    return (void*)futex_wake(task, uaddr, count);
+}
+
+
+// Hits and misses of the disk block cache, commands and merges of the queue.
+void* isr80h_command8_disk_stats(struct interrupt_frame* frame) {
+    disk_cache_print_stats();
+    struct disk* disk = disk_get(0);
+    if (disk) {
+        disk_queue_print_stats(disk);
+    }
+    return 0;
+}
+
+
+// Contended acquisitions of the spin and ticket locks, by lock name.
+void* isr80h_command10_lock_stats(struct interrupt_frame* frame) {
+    spin_lock_print_stats();
+    return 0;
+}
+
+
+// set_affinity(cpu), run the calling thread on cpu, or anywhere with -1.
+// 0 or a negative status.
+void* isr80h_command11_set_affinity(struct interrupt_frame* frame) {
+    struct task* task = task_current();
+    int          cpu  = (int)task_get_stack_item(task, 0);
+    int          res  = task_set_affinity(task, cpu);
+    if (res == 0 && cpu != TASK_AFFINITY_ANY) {
+        // Moves at this switch.
+        task_next();
+    }
+    return (void*)res;
+}
@@ -0,0 +1,18 @@
+#ifndef _ISR80H_MISC_H
+#define _ISR80H_MISC_H
+
+struct interrupt_frame;
+
+void* isr80h_command0_irq_stats(struct interrupt_frame* frame);
+void* isr80h_command1_sleep(struct interrupt_frame* frame);
+void* isr80h_command2_switch_stats(struct interrupt_frame* frame);
+void* isr80h_command3_thread_create(struct interrupt_frame* frame);
+void* isr80h_command4_thread_join(struct interrupt_frame* frame);
+void* isr80h_command5_thread_exit(struct interrupt_frame* frame);
+void* isr80h_command6_futex_wait(struct interrupt_frame* frame);
+void* isr80h_command7_futex_wake(struct interrupt_frame* frame);
+void* isr80h_command8_disk_stats(struct interrupt_frame* frame);
+void* isr80h_command10_lock_stats(struct interrupt_frame* frame);
+void* isr80h_command11_set_affinity(struct interrupt_frame* frame);
+
+#endif
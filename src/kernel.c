@@ -1,5 +1,9 @@
 #include <stdint.h>
 #include "config.h"
+#include "cpu/cpu.h"
+#include "cpu/fpu.h"
+#include "apic/apic.h"
+#include "disk/ata_dma.h"
 #include "disk/disk.h"
 #include "disk/streamer.h"
 #include "gdt/gdt.h"
@@ -8,11 +12,17 @@
 #include "fs/file.h"
 #include "memory/memory.h"
 #include "idt/idt.h"
+#include "idt/irq.h"
 #include "io/io.h"
+#include "isr80h/isr80h.h"
 #include "memory/heap/kheap.h"
 #include "memory/paging/paging.h"
+#include "smp/smp.h"
+#include "status.h"
 #include "string/string.h"
+#include "task/task.h"
 #include "task/tss.h"
+#include "timer/timer.h"
 
 
 
@@ -75,7 +85,11 @@ void print(const char* str) {
 
 void panic(const char* msg) {
     print(msg);
-    while (1) {}
+    // hlt with interrupts off, instead of spinning the (host) CPU.
+    disable_interrupts();
+    while (1) {
+        cpu_halt();
+    }
 }
 
 
@@ -87,8 +101,6 @@ void kernel_page() {
 }
 
 
-struct tss tss;
-
 struct gdt gdt_real[RAOS_TOTAL_GDT_SEGMENTS];
 struct gdt_structured gdt_structured[RAOS_TOTAL_GDT_SEGMENTS] = {
     {.base = 0x00, .limit = 0x00, .type = 0x00},                // NULL Segment
@@ -96,10 +108,40 @@ struct gdt_structured gdt_structured[RAOS_TOTAL_GDT_SEGMENTS] = {
     {.base = 0x00, .limit = 0xffffffff, .type = 0x92},            // Kernel data segment
     {.base = 0x00, .limit = 0xffffffff, .type = 0xf8},              // User code segment
     {.base = 0x00, .limit = 0xffffffff, .type = 0xf2},             // User data segment
-    {.base = (uint32_t)&tss, .limit=sizeof(tss), .type = 0xE9}      // TSS Segment
+    // TSS Segments of each CPU, filled in by kernel_main().
 };
 
 
+/**
+ * @brief Entry of an application processor, called by smp_init() through
+ *        the trampoline with paging on. Never returns.
+ *
+ * @param cpu
+ */
+void kernel_ap_main(struct cpu* cpu) {
+    gdt_load(gdt_real, sizeof(gdt_real));
+    kernel_registers();
+    idt_ap_init();
+
+    memset(&cpu->tss, 0, sizeof(cpu->tss));
+    cpu->tss.esp0 = (uint32_t)cpu->kernel_stack + RAOS_CPU_KERNEL_STACK_SIZE;
+    cpu->tss.ss0  = KERNEL_DATA_SELECTOR;
+    tss_load(cpu_tss_selector(cpu));
+
+    paging_switch(kernel_chunk);
+
+    apic_ap_init();
+    timer_ap_init();
+    fpu_ap_init();
+
+    cpu->online = true;
+    enable_interrupts();
+
+    // Runs tasks stolen from the other CPUs' run queues.
+    task_idle();
+}
+
+
 // For IDT test
 // extern void problem();
 
@@ -107,8 +149,19 @@ struct gdt_structured gdt_structured[RAOS_TOTAL_GDT_SEGMENTS] = {
 void kernel_main() {
     terminal_initialize();
 
+    // The bootstrap processor is cpu 0.
+    smp_early_init();
+
     // load the gdt
     memset(gdt_real, 0, sizeof(gdt_real));
+    for (int i = 0; i < RAOS_MAX_CPUS; ++i) {
+        struct cpu* cpu = cpu_get(i);
+        struct gdt_structured* tss_segment =
+            &gdt_structured[RAOS_GDT_TSS_INDEX + i];
+        tss_segment->base  = (uint32_t)&cpu->tss;
+        tss_segment->limit = sizeof(cpu->tss);
+        tss_segment->type  = 0xE9;
+    }
     gdt_structured_to_gdt(gdt_real, gdt_structured, RAOS_TOTAL_GDT_SEGMENTS);
     gdt_load(gdt_real, sizeof(gdt_real));
 
@@ -127,19 +180,29 @@ void kernel_main() {
     // init file system
     fs_init();
 
-    // Search and initialize the disks.
-    disk_search_and_init();
-
     // IDT initialization.
     idt_init();
 
+    // Register the int 0x80 system commands.
+    isr80h_init();
+
+    // TLB shootdowns between the CPUs.
+    paging_tlb_init();
+
+    // Lazy FPU/SSE switching, traps the first FPU use after a switch.
+    fpu_init();
+
+    // Bus master DMA for the disk, once its IRQ can be handled.
+    ata_dma_init();
+
     // TSS initialization.
-    memset(&tss, 0, sizeof(tss));
-    tss.esp0 = 0x600000;   // kernel stack address
-    tss.ss0  = KERNEL_DATA_SELECTOR;
+    struct cpu* bsp = cpu_current();
+    memset(&bsp->tss, 0, sizeof(bsp->tss));
+    bsp->tss.esp0 = 0x600000;   // until the first task, task_next() sets each task's
+    bsp->tss.ss0  = KERNEL_DATA_SELECTOR;
 
     // Load TSS
-    tss_load(0x28);  // 0x28 is the offset of TSS segment in GDT.
+    tss_load(cpu_tss_selector(bsp));  // 0x28, the offset of cpu 0 TSS segment in GDT.
 
     // Setup paging
     kernel_chunk = paging_new_4gb(PAGING_IS_WRITABLE | PAGING_IS_PRESENT
@@ -151,9 +214,25 @@ void kernel_main() {
     // Enable paginng
     enable_paging();
 
+    // Local APIC and IOAPIC replace the 8259 PIC when ACPI describes them.
+    if (apic_init(kernel_chunk) == RAOS_ALL_OK) {
+        irq_use_apic();
+    }
+
+    // Scheduling tick.
+    timer_init();
+
+    // Bring up the application processors.
+    smp_init(paging_4gb_chunk_get_directory(kernel_chunk));
+
     // enable interrupts after IDT initialized.
     enable_interrupts();
 
+    // Search and initialize the disks. The probe and partition reads give
+    // up on a silent drive through timer wheel timeouts, so the tick must
+    // be running.
+    disk_search_and_init();
+
     // === Begin === For fopen test 
     int fd = fopen("0:/message.txt", "r");
     if (fd) {
@@ -235,7 +314,8 @@ void kernel_main() {
     // if (ptr1 || ptr2 || ptr3 || ptr4) { }
     // === End === For kernel malloc test
 
-    while (1) {}
+    // The bootstrap processor becomes an idle CPU as well.
+    task_idle();
 
     return;
 }
\ No newline at end of file
@@ -8,10 +8,13 @@
 #define ERROR_I(val) (int)(val)
 #define ISERR(val) ((int)(val) < 0)
 
+struct cpu;
+
 void panic(const char* msg);
 void print(const char* str);
 void kernel_main();
 void kernel_page();
 void kernel_registers();
+void kernel_ap_main(struct cpu* cpu);
 
 #endif
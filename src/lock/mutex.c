@@ -0,0 +1,88 @@
+#include "mutex.h"
+#include "../cpu/cpu.h"
+#include "../idt/idt.h"
+#include "../kernel.h"
+#include "../task/task.h"
+
+
+void mutex_init(struct mutex* mutex, const char* name) {
+    spin_lock_init(&mutex->lock, name);
+    mutex->locked = false;
+    mutex->head   = 0;
+    mutex->tail   = 0;
+    mutex->name   = name;
+}
+
+
+// mutex->lock must be held.
+static void mutex_waiter_remove(struct mutex* mutex,
+                                struct mutex_waiter* waiter) {
+    struct mutex_waiter* prev = 0;
+    for (struct mutex_waiter* w = mutex->head; w; prev = w, w = w->next) {
+        if (w != waiter) {
+            continue;
+        }
+
+        if (prev) {
+            prev->next = w->next;
+        } else {
+            mutex->head = w->next;
+        }
+        if (mutex->tail == w) {
+            mutex->tail = prev;
+        }
+        return;
+    }
+}
+
+
+void mutex_lock(struct mutex* mutex) {
+    // It would sleep in place of whatever task the interrupt came in on.
+    if (idt_in_interrupt()) {
+        panic("mutex_lock(): Called in interrupt context\n");
+    }
+
+    struct task*        task   = task_current();
+    struct mutex_waiter waiter = {.task = task};
+
+    uint32_t flags = spin_lock_irqsave(&mutex->lock);
+    while (mutex->locked) {
+        if (!task) {
+            spin_unlock_irqrestore(&mutex->lock, flags);
+            cpu_pause();
+            flags = spin_lock_irqsave(&mutex->lock);
+            continue;
+        }
+
+        // Queued under the lock, mutex_unlock() dequeues and wakes us.
+        waiter.next = 0;
+        if (mutex->tail) {
+            mutex->tail->next = &waiter;
+        } else {
+            mutex->head = &waiter;
+        }
+        mutex->tail = &waiter;
+
+        flags = task_wait(&mutex->lock, flags);
+        // Still queued when woken up by someone else, process_terminate().
+        mutex_waiter_remove(mutex, &waiter);
+    }
+
+    mutex->locked = true;
+    spin_unlock_irqrestore(&mutex->lock, flags);
+}
+
+
+void mutex_unlock(struct mutex* mutex) {
+    uint32_t             flags  = spin_lock_irqsave(&mutex->lock);
+    struct mutex_waiter* waiter = mutex->head;
+    mutex->locked               = false;
+    if (waiter) {
+        mutex->head = waiter->next;
+        if (!mutex->head) {
+            mutex->tail = 0;
+        }
+        task_wakeup(waiter->task);
+    }
+    spin_unlock_irqrestore(&mutex->lock, flags);
+}
@@ -0,0 +1,34 @@
+#ifndef _MUTEX_H
+#define _MUTEX_H
+
+#include <stdbool.h>
+
+#include "spinlock.h"
+
+struct task;
+
+// A task waiting in mutex_lock(), see task_wait().
+struct mutex_waiter {
+    struct task*         task;
+    struct mutex_waiter* next;
+};
+
+// Sleeping lock for long critical sections, like a disk command. A task
+// waiting for it gives its CPU to other tasks, without a task (boot, the idle
+// loop) it spins.
+struct mutex {
+    struct spinlock      lock;  // guards locked and the waiter list
+    volatile bool        locked;
+    struct mutex_waiter* head;
+    struct mutex_waiter* tail;
+    const char*          name;
+};
+
+#define MUTEX_INIT(mutex_name)                                                 \
+    { .lock = SPINLOCK_INIT(mutex_name), .locked = false, .name = mutex_name }
+
+void mutex_init(struct mutex* mutex, const char* name);
+void mutex_lock(struct mutex* mutex);
+void mutex_unlock(struct mutex* mutex);
+
+#endif
@@ -0,0 +1,135 @@
+#include "spinlock.h"
+#include "../config.h"
+#include "../cpu/cpu.h"
+#include "../kernel.h"
+#include "../string/string.h"
+
+
+// Contended acquisitions summed by lock name. A lock may be freed, its name
+// is a string literal that stays.
+static struct lock_stats {
+    const char* volatile name;
+    volatile uint32_t    contended;
+} lock_stats[RAOS_MAX_LOCK_STATS];
+
+
+// Count a contended acquisition of a lock, lock-free: a new name takes the
+// first empty slot with a compare and swap.
+static void lock_stats_count(const char* name) {
+    if (!name) {
+        name = "?";
+    }
+
+    for (int i = 0; i < RAOS_MAX_LOCK_STATS; ++i) {
+        struct lock_stats* stats = &lock_stats[i];
+        if (stats->name == name
+            || (!stats->name
+                && (__sync_bool_compare_and_swap(&stats->name, 0, name)
+                    || stats->name == name))) {
+            __sync_fetch_and_add(&stats->contended, 1);
+            return;
+        }
+    }
+}
+
+
+// Print the contended acquisitions of every lock name, the waits of the
+// ticket locks included.
+void spin_lock_print_stats() {
+    char buf[16];
+    print("lock contended\n");
+    for (int i = 0; i < RAOS_MAX_LOCK_STATS && lock_stats[i].name; ++i) {
+        print(lock_stats[i].name);
+        print(" ");
+        print(uitoa(lock_stats[i].contended, buf, 10));
+        print("\n");
+    }
+}
+
+
+void spin_lock_init(struct spinlock* lock, const char* name) {
+    lock->locked    = 0;
+    lock->contended = 0;
+    lock->name      = name;
+}
+
+
+bool spin_trylock(struct spinlock* lock) {
+    return __sync_lock_test_and_set(&lock->locked, 1) == 0;
+}
+
+
+void spin_lock(struct spinlock* lock) {
+    if (spin_trylock(lock)) {
+        return;
+    }
+
+    __sync_fetch_and_add(&lock->contended, 1);
+    lock_stats_count(lock->name);
+    do {
+        while (lock->locked) {
+            cpu_pause();
+        }
+    } while (!spin_trylock(lock));
+}
+
+
+void spin_unlock(struct spinlock* lock) {
+    __sync_lock_release(&lock->locked);
+}
+
+
+uint32_t spin_lock_irqsave(struct spinlock* lock) {
+    uint32_t flags = cpu_irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+
+void spin_unlock_irqrestore(struct spinlock* lock, uint32_t flags) {
+    spin_unlock(lock);
+    cpu_irq_restore(flags);
+}
+
+
+void ticket_lock_init(struct ticketlock* lock, const char* name) {
+    lock->next      = 0;
+    lock->owner     = 0;
+    lock->contended = 0;
+    lock->name      = name;
+}
+
+
+void ticket_lock(struct ticketlock* lock) {
+    uint16_t ticket = __sync_fetch_and_add(&lock->next, 1);
+    if (lock->owner == ticket) {
+        return;
+    }
+
+    __sync_fetch_and_add(&lock->contended, 1);
+    lock_stats_count(lock->name);
+    while (lock->owner != ticket) {
+        cpu_pause();
+    }
+    __sync_synchronize();
+}
+
+
+void ticket_unlock(struct ticketlock* lock) {
+    // Only the holder writes owner, a barrier orders the critical section.
+    __sync_synchronize();
+    lock->owner++;
+}
+
+
+uint32_t ticket_lock_irqsave(struct ticketlock* lock) {
+    uint32_t flags = cpu_irq_save();
+    ticket_lock(lock);
+    return flags;
+}
+
+
+void ticket_unlock_irqrestore(struct ticketlock* lock, uint32_t flags) {
+    ticket_unlock(lock);
+    cpu_irq_restore(flags);
+}
@@ -0,0 +1,46 @@
+#ifndef _SPINLOCK_H
+#define _SPINLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Test-and-test-and-set lock, waiters spin on a plain read so the cache line
+// is only written when the lock looks free.
+struct spinlock {
+    volatile uint32_t locked;
+    uint32_t          contended;  // acquisitions that had to wait
+    const char*       name;
+};
+
+// FIFO lock, waiters are served in arrival order.
+struct ticketlock {
+    volatile uint16_t next;   // ticket of the next arriving waiter
+    volatile uint16_t owner;  // ticket being served
+    uint32_t          contended;
+    const char*       name;
+};
+
+#define SPINLOCK_INIT(lock_name)                                               \
+    { .locked = 0, .contended = 0, .name = lock_name }
+#define TICKETLOCK_INIT(lock_name)                                             \
+    { .next = 0, .owner = 0, .contended = 0, .name = lock_name }
+
+void spin_lock_init(struct spinlock* lock, const char* name);
+void spin_lock(struct spinlock* lock);
+bool spin_trylock(struct spinlock* lock);
+void spin_unlock(struct spinlock* lock);
+
+// Also disable interrupts on this CPU, for data interrupt handlers touch.
+uint32_t spin_lock_irqsave(struct spinlock* lock);
+void     spin_unlock_irqrestore(struct spinlock* lock, uint32_t flags);
+
+void ticket_lock_init(struct ticketlock* lock, const char* name);
+void ticket_lock(struct ticketlock* lock);
+void ticket_unlock(struct ticketlock* lock);
+
+uint32_t ticket_lock_irqsave(struct ticketlock* lock);
+void     ticket_unlock_irqrestore(struct ticketlock* lock, uint32_t flags);
+
+void spin_lock_print_stats();
+
+#endif
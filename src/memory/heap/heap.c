@@ -244,4 +244,27 @@ void heap_mark_block_free(struct heap* heap, int start_block) {
 void heap_free(struct heap* heap, void* ptr) {
     int start_block = heap_address_to_block(heap, ptr);
     heap_mark_block_free(heap, start_block);
+}
+
+
+/**
+ * @brief Check if ptr is an allocation of exactly one block. Only reads the
+ * entry of ptr, which does not change while the caller owns the allocation.
+ *
+ * @param heap heap structure.
+ * @param ptr starting address of an allocation.
+ * @return int 1 if the allocation is one block long.
+ */
+int heap_is_single_block(struct heap* heap, void* ptr) {
+    if (ptr < heap->saddr || !heap_validate_alignment(ptr)) {
+        return 0;
+    }
+
+    int block = heap_address_to_block(heap, ptr);
+    if (block >= (int)heap->table->total) {
+        return 0;
+    }
+
+    HEAP_BLOCK_TABLE_ENTRY entry = heap->table->entries[block];
+    return (entry & HEAP_BLOCK_IS_FIRST) && !(entry & HEAP_BLOCK_HAS_NEXT);
 }
\ No newline at end of file
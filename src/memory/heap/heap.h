@@ -34,4 +34,6 @@ void* heap_malloc(struct heap* heap, size_t size);
 
 void heap_free(struct heap* heap, void* ptr);
 
+int heap_is_single_block(struct heap* heap, void* ptr);
+
 #endif
\ No newline at end of file
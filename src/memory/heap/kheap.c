@@ -2,10 +2,26 @@
 #include "../../kernel.h"
 #include "../memory.h"
 #include "heap.h"
+#include "../../lock/spinlock.h"
+#include "../../cpu/cpu.h"
+#include "../../smp/smp.h"
 
 struct heap       kernel_heap;
 struct heap_table kernel_heap_table;
 
+// Interrupt handlers and every CPU allocate from the one heap table.
+static struct spinlock kernel_heap_lock = SPINLOCK_INIT("kernel_heap");
+
+// Free single block allocations kept by one CPU. Blocks in a magazine stay
+// taken in the heap table, only the owning CPU touches the magazine, with
+// interrupts off, so the fast path needs no lock.
+struct kheap_magazine {
+    void* blocks[RAOS_KHEAP_MAGAZINE_SIZE];
+    int   count;
+};
+
+static struct kheap_magazine kheap_magazines[RAOS_MAX_CPUS];
+
 void kheap_init() {
     uint32_t total_table_entries = RAOS_HEAP_SIZE_BYTES / RAOS_HEAP_BLOCK_SIZE;
 
@@ -23,9 +39,89 @@ void kheap_init() {
     }
 }
 
-void* kmalloc(size_t size) { return heap_malloc(&kernel_heap, size); }
+/**
+ * @brief Take up to RAOS_KHEAP_MAGAZINE_BATCH blocks from the heap in one
+ *        lock round trip. Interrupts must be off.
+ *
+ * @param magazine magazine of this CPU
+ */
+static void kheap_magazine_refill(struct kheap_magazine* magazine) {
+    spin_lock(&kernel_heap_lock);
+    while (magazine->count < RAOS_KHEAP_MAGAZINE_BATCH) {
+        void* block = heap_malloc(&kernel_heap, RAOS_HEAP_BLOCK_SIZE);
+        if (!block) {
+            break;
+        }
+        magazine->blocks[magazine->count++] = block;
+    }
+    spin_unlock(&kernel_heap_lock);
+}
+
 
-void kfree(void* ptr) { heap_free(&kernel_heap, ptr); }
+/**
+ * @brief Give RAOS_KHEAP_MAGAZINE_BATCH blocks back to the heap in one lock
+ *        round trip. Interrupts must be off.
+ *
+ * @param magazine magazine of this CPU
+ */
+static void kheap_magazine_flush(struct kheap_magazine* magazine) {
+    spin_lock(&kernel_heap_lock);
+    for (int i = 0; i < RAOS_KHEAP_MAGAZINE_BATCH && magazine->count > 0; ++i) {
+        heap_free(&kernel_heap, magazine->blocks[--magazine->count]);
+    }
+    spin_unlock(&kernel_heap_lock);
+}
+
+
+void* kmalloc(size_t size) {
+    uint32_t flags = cpu_irq_save();
+    void*    ptr   = NULL;
+
+    // Single block requests are served by the magazine of this CPU.
+    if (size <= RAOS_HEAP_BLOCK_SIZE) {
+        struct kheap_magazine* magazine = &kheap_magazines[cpu_current()->id];
+        if (magazine->count == 0) {
+            kheap_magazine_refill(magazine);
+        }
+
+        if (magazine->count > 0) {
+            ptr = magazine->blocks[--magazine->count];
+        }
+        goto out;
+    }
+
+    spin_lock(&kernel_heap_lock);
+    ptr = heap_malloc(&kernel_heap, size);
+    spin_unlock(&kernel_heap_lock);
+
+out:
+    cpu_irq_restore(flags);
+    return ptr;
+}
+
+void kfree(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    uint32_t flags = cpu_irq_save();
+    if (heap_is_single_block(&kernel_heap, ptr)) {
+        struct kheap_magazine* magazine = &kheap_magazines[cpu_current()->id];
+        if (magazine->count == RAOS_KHEAP_MAGAZINE_SIZE) {
+            kheap_magazine_flush(magazine);
+        }
+
+        magazine->blocks[magazine->count++] = ptr;
+        goto out;
+    }
+
+    spin_lock(&kernel_heap_lock);
+    heap_free(&kernel_heap, ptr);
+    spin_unlock(&kernel_heap_lock);
+
+out:
+    cpu_irq_restore(flags);
+}
 
 void* kzalloc(size_t size) {
     void* ptr = kmalloc(size);
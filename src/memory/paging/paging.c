@@ -1,10 +1,12 @@
 #include "paging.h"
 #include "../../status.h"
 #include "../heap/kheap.h"
+#include "../../smp/smp.h"
+#include "../../cpu/cpu.h"
+#include "../../apic/apic.h"
+#include "../../idt/idt.h"
 
 
-static uint32_t* current_directory = 0;
-
 // function prototype, implement in paging.asm
 void paging_load_directory(uint32_t* directory);
 
@@ -44,8 +46,93 @@ struct paging_4gb_chunk* paging_new_4gb(uint8_t flags) {
  * @param directory
  */
 void paging_switch(struct paging_4gb_chunk* directory) {
-    paging_load_directory(directory->directory_entry);
-    current_directory = directory->directory_entry;
+    uint32_t    flags = cpu_irq_save();
+    struct cpu* cpu   = cpu_current();
+    // Reloading CR3 flushes the TLB, skip it when nothing changes.
+    if (cpu->current_directory != directory->directory_entry) {
+        // Published before the load: a CPU changing the directory's entries
+        // either sees it here and shoots us down, or wrote them before.
+        cpu->current_directory = directory->directory_entry;
+        __sync_synchronize();
+        paging_load_directory(directory->directory_entry);
+    }
+    cpu_irq_restore(flags);
+}
+
+
+/**
+ * @brief Reload CR3 if another CPU asked for it. Also polled by a CPU
+ *        waiting for its own shootdown, so two of them never wait for each
+ *        other with interrupts off.
+ *
+ */
+static void paging_tlb_flush_local() {
+    struct cpu* cpu = cpu_current();
+    if (!cpu->tlb_flush) {
+        return;
+    }
+
+    // Cleared first, a request arriving meanwhile reloads once more.
+    cpu->tlb_flush = false;
+    __sync_synchronize();
+    if (cpu->current_directory) {
+        paging_load_directory(cpu->current_directory);
+    }
+}
+
+
+static void paging_tlb_interrupt_handler(struct interrupt_frame* frame) {
+    paging_tlb_flush_local();
+}
+
+
+/**
+ * @brief Drop the stale TLB entries of pages changed in directory, on this
+ *        CPU and on every other CPU that has it loaded, and wait until they
+ *        did. Must not be called holding a spinlock another CPU may spin on
+ *        with interrupts off.
+ *
+ * @param directory
+ * @param virt first page changed
+ * @param count number of pages changed
+ */
+static void paging_tlb_shootdown(uint32_t* directory, void* virt, int count) {
+    uint32_t    flags = cpu_irq_save();
+    struct cpu* self  = cpu_current();
+    if (self->current_directory == directory) {
+        for (int i = 0; i < count; i++) {
+            cpu_invlpg(virt + i * PAGING_PAGE_SIZE);
+        }
+    }
+
+    // The entries are written before looking at the loaded directories,
+    // see paging_switch().
+    __sync_synchronize();
+    for (int i = 0; i < smp_total_cpus(); i++) {
+        struct cpu* cpu = cpu_get(i);
+        if (cpu == self || !cpu->online || cpu->current_directory != directory) {
+            continue;
+        }
+
+        cpu->tlb_flush = true;
+        lapic_send_fixed(cpu->apic_id, APIC_TLB_FLUSH_VECTOR);
+    }
+
+    for (int i = 0; i < smp_total_cpus(); i++) {
+        struct cpu* cpu = cpu_get(i);
+        while (cpu != self && cpu->tlb_flush) {
+            paging_tlb_flush_local();
+            cpu_pause();
+        }
+    }
+    cpu_irq_restore(flags);
+}
+
+
+// Answer the shootdowns of other CPUs.
+void paging_tlb_init() {
+    idt_register_interrupt_callback(APIC_TLB_FLUSH_VECTOR,
+                                    paging_tlb_interrupt_handler);
 }
 
 uint32_t* paging_4gb_chunk_get_directory(struct paging_4gb_chunk* chunk) {
@@ -97,15 +184,9 @@ uint32_t paging_get(uint32_t* directory, void* virt) {
 }
 
 
-/**
- * @brief Mapping virtual address with physical address.
- *
- * @param directory page directory to use.
- * @param virt virtual address
- * @param physic physical address to be mapped.
- * @return int
- */
-int paging_set(uint32_t* directory, void* virt, uint32_t physic) {
+// Write the page entry of virt, ORing into was_present if the old one was.
+static int paging_set_entry(uint32_t* directory, void* virt, uint32_t physic,
+                            bool* was_present) {
     if (!paging_is_aligned(virt)) {
         return -EINVARG;
     }
@@ -120,12 +201,34 @@ int paging_set(uint32_t* directory, void* virt, uint32_t physic) {
     uint32_t  entry = directory[directory_idx];
     uint32_t* table = (uint32_t*)(entry & 0xfffff000);  // aligned to 4096
 
+    // Only a present entry can be cached in a TLB.
+    *was_present |= table[table_idx] & PAGING_IS_PRESENT;
     table[table_idx] = physic;
-
     return 0;
 }
 
 
+/**
+ * @brief Mapping virtual address with physical address.
+ *
+ * @param directory page directory to use.
+ * @param virt virtual address
+ * @param physic physical address to be mapped.
+ * @return int
+ */
+int paging_set(uint32_t* directory, void* virt, uint32_t physic) {
+    bool was_present = false;
+    int  res         = paging_set_entry(directory, virt, physic, &was_present);
+    // paging_switch() does not reload CR3 for the loaded directory, so its
+    // stale TLB entries have to go, on every CPU running it.
+    if (res == 0 && was_present) {
+        paging_tlb_shootdown(directory, virt, 1);
+    }
+
+    return res;
+}
+
+
 void paging_free_4gb(struct paging_4gb_chunk* chunk) {
     for (int i = 0; i < 1024; i++) {
         uint32_t entry = chunk->directory_entry[i];
@@ -134,6 +237,13 @@ void paging_free_4gb(struct paging_4gb_chunk* chunk) {
         kfree(table);
     }
 
+    // A new directory reusing the address must not look already loaded.
+    uint32_t flags = cpu_irq_save();
+    if (cpu_current()->current_directory == chunk->directory_entry) {
+        cpu_current()->current_directory = 0;
+    }
+    cpu_irq_restore(flags);
+
     kfree(chunk->directory_entry);
     kfree(chunk);
 }
@@ -153,14 +263,28 @@ int paging_map(struct paging_4gb_chunk* directory, void* virt, void* phys,
 
 int paging_map_range(struct paging_4gb_chunk* directory, void* virt, void* phys,
                      int count, int flags) {
-    int res = 0;
-    for (int i = 0; i < count; i++) {
-        res = paging_map(directory, virt, phys, flags);
+    if (((unsigned int)virt % PAGING_PAGE_SIZE)
+        || ((unsigned int)phys % PAGING_PAGE_SIZE)) {
+        return -EINVARG;
+    }
+
+    // One shootdown for the whole range.
+    int   res         = 0;
+    int   done        = 0;
+    bool  was_present = false;
+    void* start       = virt;
+    for (; done < count; done++) {
+        res = paging_set_entry(directory->directory_entry, virt,
+                               (uint32_t)phys | flags, &was_present);
         if (res < 0) break;
         virt += PAGING_PAGE_SIZE;
         phys += PAGING_PAGE_SIZE;
     }
 
+    if (was_present) {
+        paging_tlb_shootdown(directory->directory_entry, start, done);
+    }
+
     return res;
 }
 
@@ -22,6 +22,7 @@ struct paging_4gb_chunk {
 
 void enable_paging();
 void paging_switch(struct paging_4gb_chunk* directory);
+void paging_tlb_init();
 
 struct paging_4gb_chunk* paging_new_4gb(uint8_t flags);
 uint32_t* paging_4gb_chunk_get_directory(struct paging_4gb_chunk* chunk);
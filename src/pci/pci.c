@@ -0,0 +1,94 @@
+#include "pci.h"
+#include "../io/io.h"
+#include "../status.h"
+
+
+static uint32_t pci_address(uint8_t bus, uint8_t slot, uint8_t function,
+                            uint8_t offset) {
+    return 0x80000000 | (bus << 16) | (slot << 11) | (function << 8)
+           | (offset & 0xFC);
+}
+
+
+static uint32_t pci_read(uint8_t bus, uint8_t slot, uint8_t function,
+                         uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(bus, slot, function, offset));
+    return insl(PCI_CONFIG_DATA);
+}
+
+
+uint32_t pci_config_read(struct pci_device* device, uint8_t offset) {
+    return pci_read(device->bus, device->slot, device->function, offset);
+}
+
+
+void pci_config_write(struct pci_device* device, uint8_t offset,
+                      uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(device->bus, device->slot,
+                                         device->function, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+
+/**
+ * @brief Find the first function of a device class by brute force over all
+ *        buses and slots.
+ *
+ * https://wiki.osdev.org/PCI
+ *
+ * @param class_code
+ * @param subclass
+ * @param out
+ * @return int
+ */
+int pci_find_class(uint8_t class_code, uint8_t subclass,
+                   struct pci_device* out) {
+    for (int bus = 0; bus < 256; ++bus) {
+        for (int slot = 0; slot < 32; ++slot) {
+            for (int function = 0; function < 8; ++function) {
+                uint32_t id = pci_read(bus, slot, function, PCI_REG_VENDOR_DEVICE);
+                if ((id & 0xFFFF) == 0xFFFF) {
+                    if (function == 0) {
+                        break;  // no device in the slot
+                    }
+                    continue;
+                }
+
+                uint32_t class = pci_read(bus, slot, function, PCI_REG_CLASS);
+                if ((class >> 24) == class_code
+                    && ((class >> 16) & 0xFF) == subclass) {
+                    out->bus        = bus;
+                    out->slot       = slot;
+                    out->function   = function;
+                    out->vendor_id  = id & 0xFFFF;
+                    out->device_id  = id >> 16;
+                    out->class_code = class >> 24;
+                    out->subclass   = (class >> 16) & 0xFF;
+                    out->prog_if    = (class >> 8) & 0xFF;
+                    return 0;
+                }
+
+                // Only multi-function devices have functions 1-7.
+                uint32_t header = pci_read(bus, slot, function, PCI_REG_HEADER_TYPE);
+                if (function == 0 && !(header & 0x00800000)) {
+                    break;
+                }
+            }
+        }
+    }
+
+    return -EIO;
+}
+
+
+uint32_t pci_bar(struct pci_device* device, int index) {
+    return pci_config_read(device, PCI_REG_BAR0 + index * 4);
+}
+
+
+void pci_enable_bus_master(struct pci_device* device) {
+    uint32_t command = pci_config_read(device, PCI_REG_COMMAND);
+    // The upper half is the status register, writing its 1 bits clears them.
+    command = (command & 0xFFFF) | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER;
+    pci_config_write(device, PCI_REG_COMMAND, command);
+}
@@ -0,0 +1,43 @@
+#ifndef _PCI_H
+#define _PCI_H
+
+#include <stdint.h>
+
+// Configuration space access mechanism #1.
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+#define PCI_REG_VENDOR_DEVICE 0x00
+#define PCI_REG_COMMAND       0x04
+#define PCI_REG_CLASS         0x08
+#define PCI_REG_HEADER_TYPE   0x0C
+#define PCI_REG_BAR0          0x10
+
+#define PCI_COMMAND_IO          0x0001
+#define PCI_COMMAND_BUS_MASTER  0x0004
+#define PCI_BAR_IO              0x1
+
+#define PCI_CLASS_STORAGE  0x01
+#define PCI_SUBCLASS_IDE   0x01
+
+struct pci_device {
+    uint8_t  bus;
+    uint8_t  slot;
+    uint8_t  function;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t  class_code;
+    uint8_t  subclass;
+    uint8_t  prog_if;
+};
+
+uint32_t pci_config_read(struct pci_device* device, uint8_t offset);
+void     pci_config_write(struct pci_device* device, uint8_t offset,
+                          uint32_t value);
+
+int      pci_find_class(uint8_t class_code, uint8_t subclass,
+                        struct pci_device* out);
+uint32_t pci_bar(struct pci_device* device, int index);
+void     pci_enable_bus_master(struct pci_device* device);
+
+#endif
@@ -0,0 +1,72 @@
+; Application processor start up code. It is copied to
+; RAOS_SMP_TRAMPOLINE_ADDRESS and entered in real mode by the startup IPI at
+; CS = address >> 4, IP = 0. Everything is addressed relative to the copy.
+section .asm
+
+global smp_trampoline_start
+global smp_trampoline_end
+global smp_trampoline_stack
+global smp_trampoline_cr3
+global smp_trampoline_entry
+
+; Keep in sync with RAOS_SMP_TRAMPOLINE_ADDRESS in config.h
+TRAMPOLINE_BASE equ 0x10000
+
+%define TRAMPOLINE_OFFSET(label) (label - smp_trampoline_start)
+%define TRAMPOLINE_ADDRESS(label) (TRAMPOLINE_BASE + TRAMPOLINE_OFFSET(label))
+
+[BITS 16]
+smp_trampoline_start:
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+
+    lgdt [TRAMPOLINE_OFFSET(smp_trampoline_gdt_descriptor)]
+    mov eax, cr0
+    or eax, 0x1
+    mov cr0, eax
+    jmp dword 0x08:TRAMPOLINE_ADDRESS(smp_trampoline_protected)
+
+[BITS 32]
+smp_trampoline_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    ; Filled in by smp_init() before each startup IPI.
+    mov esp, [TRAMPOLINE_ADDRESS(smp_trampoline_stack)]
+    mov ebp, esp
+
+    mov eax, [TRAMPOLINE_ADDRESS(smp_trampoline_cr3)]
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80000000
+    mov cr0, eax
+
+    mov eax, [TRAMPOLINE_ADDRESS(smp_trampoline_entry)]
+    call eax
+    jmp $
+
+; Flat code and data at the same selectors as the kernel GDT, the AP loads
+; the kernel GDT itself once it runs C code.
+smp_trampoline_gdt:
+    dq 0x0000000000000000
+    dq 0x00CF9A000000FFFF
+    dq 0x00CF92000000FFFF
+
+smp_trampoline_gdt_descriptor:
+    dw smp_trampoline_gdt_descriptor - smp_trampoline_gdt - 1
+    dd TRAMPOLINE_ADDRESS(smp_trampoline_gdt)
+
+smp_trampoline_stack:
+    dd 0
+smp_trampoline_cr3:
+    dd 0
+smp_trampoline_entry:
+    dd 0
+
+smp_trampoline_end:
@@ -0,0 +1,188 @@
+#include "smp.h"
+#include "../acpi/acpi.h"
+#include "../apic/apic.h"
+#include "../kernel.h"
+#include "../memory/heap/kheap.h"
+#include "../memory/memory.h"
+#include "../status.h"
+#include "../timer/pit.h"
+
+
+static struct cpu cpus[RAOS_MAX_CPUS];
+static int        total_cpus = 1;
+
+// Local APIC id to index in cpus.
+static uint8_t cpu_index_by_apic_id[256];
+
+// The application processor being started, read by smp_ap_entry().
+static struct cpu* volatile smp_booting_cpu = 0;
+
+// smp.asm
+extern char smp_trampoline_start[];
+extern char smp_trampoline_end[];
+extern char smp_trampoline_stack[];
+extern char smp_trampoline_cr3[];
+extern char smp_trampoline_entry[];
+
+#define SMP_STARTUP_WAIT_MS 10
+#define SMP_STARTUP_TIMEOUT_MS 100
+
+
+/**
+ * @brief The bootstrap processor is cpu 0, usable before the APIC is set up.
+ *
+ */
+void smp_early_init() {
+    memset(cpus, 0, sizeof(cpus));
+    memset(cpu_index_by_apic_id, 0, sizeof(cpu_index_by_apic_id));
+    cpus[0].id     = 0;
+    cpus[0].online = true;
+    total_cpus     = 1;
+}
+
+
+struct cpu* cpu_current() {
+    return &cpus[cpu_index_by_apic_id[lapic_id()]];
+}
+
+
+struct cpu* cpu_get(int id) {
+    if (id < 0 || id >= RAOS_MAX_CPUS) {
+        return 0;
+    }
+
+    return &cpus[id];
+}
+
+
+int smp_total_cpus() {
+    return total_cpus;
+}
+
+
+int cpu_tss_selector(struct cpu* cpu) {
+    return (RAOS_GDT_TSS_INDEX + cpu->id) * 8;
+}
+
+
+/**
+ * @brief Interrupt an idle CPU out of hlt after giving it work (a task on
+ *        its run queue, an earlier timer). The caller publishes the work
+ *        before, the idle CPU sets idle before looking for work, so one of
+ *        the two always sees the other.
+ *
+ * @param cpu
+ */
+void cpu_wakeup(struct cpu* cpu) {
+    __sync_synchronize();
+    if (!cpu->idle || cpu == cpu_current() || !apic_is_enabled()) {
+        return;
+    }
+
+    lapic_send_fixed(cpu->apic_id, APIC_WAKEUP_VECTOR);
+}
+
+
+static void smp_delay_ms(int ms) {
+    pit_oneshot_start(ms);
+    while (!pit_oneshot_expired()) {}
+}
+
+
+// Address of a trampoline variable in the copy below 1MiB.
+static uint32_t* smp_trampoline_field(char* symbol) {
+    return (uint32_t*)(RAOS_SMP_TRAMPOLINE_ADDRESS
+                       + (symbol - smp_trampoline_start));
+}
+
+
+static void smp_ap_entry() {
+    kernel_ap_main(smp_booting_cpu);
+}
+
+
+/**
+ * @brief INIT-SIPI-SIPI one application processor and wait until it
+ *        reports online from kernel_ap_main().
+ *
+ * @param cpu
+ * @param directory page directory the AP enables paging with.
+ * @return int
+ */
+static int smp_start_cpu(struct cpu* cpu, uint32_t* directory) {
+    cpu->kernel_stack = kzalloc(RAOS_CPU_KERNEL_STACK_SIZE);
+    cpu->boot_stack   = kzalloc(RAOS_CPU_KERNEL_STACK_SIZE);
+    if (!cpu->kernel_stack || !cpu->boot_stack) {
+        goto out_err;
+    }
+
+    *smp_trampoline_field(smp_trampoline_stack) =
+        (uint32_t)cpu->boot_stack + RAOS_CPU_KERNEL_STACK_SIZE;
+    *smp_trampoline_field(smp_trampoline_cr3)   = (uint32_t)directory;
+    *smp_trampoline_field(smp_trampoline_entry) = (uint32_t)smp_ap_entry;
+    smp_booting_cpu                             = cpu;
+
+    lapic_send_init(cpu->apic_id);
+    smp_delay_ms(SMP_STARTUP_WAIT_MS);
+
+    // The second startup IPI only if the first one was missed.
+    for (int sipi = 0; sipi < 2 && !cpu->online; ++sipi) {
+        lapic_send_startup(cpu->apic_id, RAOS_SMP_TRAMPOLINE_ADDRESS >> 12);
+        for (int ms = 0; ms < SMP_STARTUP_TIMEOUT_MS && !cpu->online; ++ms) {
+            smp_delay_ms(1);
+        }
+    }
+
+    if (cpu->online) {
+        return 0;
+    }
+
+out_err:
+    if (cpu->kernel_stack) {
+        kfree(cpu->kernel_stack);
+    }
+    if (cpu->boot_stack) {
+        kfree(cpu->boot_stack);
+    }
+    return -EIO;
+}
+
+
+/**
+ * @brief Start every application processor the MADT lists. They come up
+ *        one at a time, so one trampoline copy is enough.
+ *
+ * @param directory kernel page directory.
+ * @return int number of online CPUs.
+ */
+int smp_init(uint32_t* directory) {
+    if (!apic_is_enabled()) {
+        return total_cpus;
+    }
+
+    uint8_t bsp_apic_id = lapic_id();
+    cpus[0].apic_id     = bsp_apic_id;
+    cpu_index_by_apic_id[bsp_apic_id] = 0;
+
+    memcpy((void*)RAOS_SMP_TRAMPOLINE_ADDRESS, smp_trampoline_start,
+           smp_trampoline_end - smp_trampoline_start);
+
+    struct acpi_madt_info* madt = acpi_madt();
+    for (int i = 0; i < madt->total_cpus && total_cpus < RAOS_MAX_CPUS; ++i) {
+        uint8_t apic_id = madt->cpu_apic_ids[i];
+        if (apic_id == bsp_apic_id) {
+            continue;
+        }
+
+        struct cpu* cpu = &cpus[total_cpus];
+        cpu->id         = total_cpus;
+        cpu->apic_id    = apic_id;
+        cpu_index_by_apic_id[apic_id] = cpu->id;
+
+        if (smp_start_cpu(cpu, directory) == 0) {
+            total_cpus++;
+        }
+    }
+
+    return total_cpus;
+}
@@ -0,0 +1,46 @@
+#ifndef _SMP_H
+#define _SMP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../config.h"
+#include "../task/tss.h"
+
+struct task;
+struct process;
+
+// Per-CPU state, cpu 0 is the bootstrap processor.
+struct cpu {
+    int           id;
+    uint8_t       apic_id;
+    volatile bool online;
+    volatile bool idle;  // in task_idle(), woken by cpu_wakeup()
+
+    // Every CPU has its own TSS (and TSS descriptor in the GDT), so the
+    // kernel stack it enters on from user land is its own.
+    struct tss tss;
+    void*      kernel_stack;
+    void*      boot_stack;  // application processors run their idle loop on it
+
+    struct task*    current_task;
+    struct task*    running_task;  // whose kernel stack this CPU is on, 0 if idle
+    struct task*    switch_prev;   // the task switched away from, see task_next()
+    struct task*    dead_task;     // exited on its own stack, freed after the switch
+    uint32_t        idle_esp;      // idle context while a task runs
+    struct task*    fpu_owner;  // whose state the FPU registers hold
+    struct process* current_process;
+    uint32_t*       current_directory;
+    volatile bool   tlb_flush;  // CR3 reload asked by another CPU
+    int             irq_depth;  // nested interrupt handlers, see idt_in_interrupt()
+};
+
+void        smp_early_init();
+int         smp_init(uint32_t* directory);
+int         smp_total_cpus();
+struct cpu* cpu_current();
+struct cpu* cpu_get(int id);
+int         cpu_tss_selector(struct cpu* cpu);
+void        cpu_wakeup(struct cpu* cpu);
+
+#endif
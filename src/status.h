@@ -11,5 +11,7 @@
 #define EUNIMP 7
 #define EISTKN 8
 #define EINFORMAT 9
+#define EINTR 10
+#define EAGAIN 11
 
 #endif
\ No newline at end of file
@@ -148,4 +148,31 @@ char tolower(char ch) {
         ch += 32;
     }
     return ch;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Convert an unsigned value to its text in base 2 to 16.
+ *
+ * @param value
+ * @param out at least 33 bytes for base 2.
+ * @param base
+ * @return char* out
+ */
+char* uitoa(uint32_t value, char* out, int base) {
+    static const char digits[] = "0123456789abcdef";
+
+    char tmp[33];
+    int  i = 0;
+    do {
+        tmp[i++] = digits[value % base];
+        value /= base;
+    } while (value);
+
+    int j = 0;
+    while (i > 0) {
+        out[j++] = tmp[--i];
+    }
+    out[j] = 0x00;
+
+    return out;
+}
@@ -20,4 +20,6 @@ bool isdigit(char c);
 int  chtoi(char c);
 char tolower(char ch);
 
+char* uitoa(uint32_t value, char* out, int base);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,155 @@
+#include "futex.h"
+#include "../config.h"
+#include "../lock/spinlock.h"
+#include "../memory/paging/paging.h"
+#include "../status.h"
+#include "process.h"
+#include "task.h"
+
+
+// A task sleeping in futex_wait(), see task_wait().
+struct futex_waiter {
+    uint32_t             key;
+    struct task*         task;
+    struct futex_waiter* next;
+    bool                 woken;
+};
+
+struct futex_bucket {
+    struct spinlock      lock;
+    struct futex_waiter* head;
+};
+
+static struct futex_bucket futex_buckets[RAOS_FUTEX_HASH_SIZE] = {
+    [0 ... RAOS_FUTEX_HASH_SIZE - 1] = {.lock = SPINLOCK_INIT("futex")},
+};
+
+_Static_assert((RAOS_FUTEX_HASH_SIZE & (RAOS_FUTEX_HASH_SIZE - 1)) == 0,
+               "RAOS_FUTEX_HASH_SIZE must be a power of two");
+
+
+static struct futex_bucket* futex_bucket(uint32_t key) {
+    // Fibonacci hashing, the low bits of word addresses are all alike.
+    return &futex_buckets[((key >> 2) * 2654435761u) >> 16
+                          & (RAOS_FUTEX_HASH_SIZE - 1)];
+}
+
+
+/**
+ * @brief The physical address of a user word, the key of its waiters. Only
+ *        memory of the task's own process is accepted.
+ *
+ * @param task
+ * @param uaddr
+ * @param key out
+ * @return int
+ */
+static int futex_key(struct task* task, void* uaddr, uint32_t* key) {
+    if ((uint32_t)uaddr & (sizeof(uint32_t) - 1)) {
+        return -EINVARG;
+    }
+
+    if (!process_owns_address(task->process, uaddr, sizeof(uint32_t))) {
+        return -EINVARG;
+    }
+
+    uint32_t* directory = task->page_directory->directory_entry;
+    uint32_t  entry = paging_get(directory, paging_align_to_lower_page(uaddr));
+    if ((entry & (PAGING_IS_PRESENT | PAGING_ACCESS_FROM_ALL))
+        != (PAGING_IS_PRESENT | PAGING_ACCESS_FROM_ALL)) {
+        return -EINVARG;
+    }
+
+    *key = (uint32_t)paging_get_physical_address(directory, uaddr);
+    return 0;
+}
+
+
+// bucket->lock must be held.
+static void futex_unlink(struct futex_bucket* bucket,
+                         struct futex_waiter* waiter) {
+    for (struct futex_waiter** pp = &bucket->head; *pp; pp = &(*pp)->next) {
+        if (*pp == waiter) {
+            *pp = waiter->next;
+            return;
+        }
+    }
+}
+
+
+/**
+ * @brief Sleep until futex_wake() on the word at uaddr, unless it no longer
+ *        holds expected. The compare and the enqueue happen under the bucket
+ *        lock, so a wake between the user's check and this call is not lost.
+ *
+ * @param task the current task
+ * @param uaddr user virtual address of the word
+ * @param expected
+ * @return int 0 when woken, -EAGAIN when the word changed, -EINTR when the
+ *         task was woken for another reason
+ */
+int futex_wait(struct task* task, void* uaddr, uint32_t expected) {
+    uint32_t key = 0;
+    int      res = futex_key(task, uaddr, &key);
+    if (res < 0) {
+        return res;
+    }
+
+    struct futex_bucket* bucket = futex_bucket(key);
+    struct futex_waiter  waiter = {.key = key, .task = task};
+
+    // The kernel sees all physical memory at its own address.
+    uint32_t flags = spin_lock_irqsave(&bucket->lock);
+    if (*(volatile uint32_t*)key != expected) {
+        spin_unlock_irqrestore(&bucket->lock, flags);
+        return -EAGAIN;
+    }
+
+    waiter.next  = bucket->head;
+    bucket->head = &waiter;
+    flags = task_wait(&bucket->lock, flags);
+    if (!waiter.woken) {
+        // Woken up by someone else, process_terminate() for one.
+        futex_unlink(bucket, &waiter);
+        res = -EINTR;
+    }
+    spin_unlock_irqrestore(&bucket->lock, flags);
+
+    return res;
+}
+
+
+/**
+ * @brief Wake up to count tasks waiting on the word at uaddr.
+ *
+ * @param task the current task
+ * @param uaddr user virtual address of the word
+ * @param count
+ * @return int the number of tasks woken up
+ */
+int futex_wake(struct task* task, void* uaddr, int count) {
+    uint32_t key = 0;
+    int      res = futex_key(task, uaddr, &key);
+    if (res < 0) {
+        return res;
+    }
+
+    struct futex_bucket* bucket = futex_bucket(key);
+    uint32_t             flags  = spin_lock_irqsave(&bucket->lock);
+    struct futex_waiter** pp    = &bucket->head;
+    while (*pp && res < count) {
+        struct futex_waiter* waiter = *pp;
+        if (waiter->key != key) {
+            pp = &waiter->next;
+            continue;
+        }
+
+        *pp           = waiter->next;
+        waiter->woken = true;
+        task_wakeup(waiter->task);
+        res++;
+    }
+    spin_unlock_irqrestore(&bucket->lock, flags);
+
+    return res;
+}
@@ -0,0 +1,15 @@
+#ifndef _FUTEX_H
+#define _FUTEX_H
+
+#include <stdint.h>
+
+struct task;
+
+// Fast user space mutex. User land keeps the lock state in a 32 bit word and
+// only enters the kernel to sleep on it or to wake its sleepers. Waiters are
+// keyed by the physical address of the word, so it also works in memory
+// shared between processes.
+int futex_wait(struct task* task, void* uaddr, uint32_t expected);
+int futex_wake(struct task* task, void* uaddr, int count);
+
+#endif
@@ -1,6 +1,8 @@
 #include "process.h"
 #include "../config.h"
+#include "../cpu/cpu.h"
 #include "../fs/file.h"
+#include "../idt/idt.h"
 #include "../kernel.h"
 #include "../loader/elfloader.h"
 #include "../memory/heap/kheap.h"
@@ -9,19 +11,21 @@
 #include "../status.h"
 #include "../string/string.h"
 #include "../task/task.h"
+#include "../smp/smp.h"
 
 
-// The current process that is running
-struct process* current_process = 0;
-
 static struct process* processes[RAOS_MAX_PROCESSES] = {};
 
 static void process_init(struct process* process) {
     memset(process, 0, sizeof(struct process));
+    spin_lock_init(&process->threads_lock, "process_threads");
 }
 
 struct process* process_current() {
-    return current_process;
+    uint32_t        flags   = cpu_irq_save();
+    struct process* process = cpu_current()->current_process;
+    cpu_irq_restore(flags);
+    return process;
 }
 
 struct process* process_get(int process_id) {
@@ -33,7 +37,7 @@ struct process* process_get(int process_id) {
 }
 
 int process_switch(struct process* process) {
-    current_process = process;
+    cpu_current()->current_process = process;
     return 0;
 }
 
@@ -60,7 +64,7 @@ void* process_malloc(struct process* process, size_t size) {
         goto out_err;
     }
 
-    int res = paging_map_to(process->task->page_directory, ptr, ptr,
+    int res = paging_map_to(process->page_directory, ptr, ptr,
                             paging_align_address(ptr + size),
                             PAGING_IS_WRITABLE | PAGING_IS_PRESENT
                                 | PAGING_ACCESS_FROM_ALL);
@@ -107,6 +111,68 @@ process_get_allocation_by_addr(struct process* process, void* addr) {
 }
 
 
+static bool process_range_holds(void* start, void* end, void* addr,
+                                size_t size) {
+    return addr >= start && addr < end && size <= (size_t)(end - addr);
+}
+
+
+static void* process_thread_stack_top(int thread_id);
+
+/**
+ * @brief True if the size bytes at the user virtual address addr are in the
+ *        program image, a thread stack or an allocation of the process.
+ *        Being mapped for user land is not enough, the kernel is too.
+ *
+ * @param process
+ * @param addr
+ * @param size
+ * @return bool
+ */
+bool process_owns_address(struct process* process, void* addr, size_t size) {
+    void* image_start = (void*)RAOS_PROGRAM_VIRTUAL_ADDRESS;
+    void* image_end   = image_start + process->size;
+    if (process->filetype == PROCESS_FILETYPE_ELF) {
+        image_start = elf_virtual_base(process->elf_file);
+        image_end   = elf_virtual_end(process->elf_file);
+    }
+    if (process_range_holds(image_start, image_end, addr, size)) {
+        return true;
+    }
+
+    void* stack_start = (void*)RAOS_PROGRAM_VIRTUAL_STACK_ADDRESS_END;
+    if (process_range_holds(stack_start,
+                            stack_start + RAOS_USER_PROGRAM_STACK_SIZE, addr,
+                            size)) {
+        return true;
+    }
+
+    bool     owned = false;
+    uint32_t flags = spin_lock_irqsave(&process->threads_lock);
+    for (int i = 1; i < RAOS_MAX_PROCESS_THREADS && !owned; i++) {
+        if (!process->threads[i].stack) {
+            continue;
+        }
+
+        void* top = process_thread_stack_top(i);
+        owned = process_range_holds(top - RAOS_USER_PROGRAM_STACK_SIZE, top,
+                                    addr, size);
+    }
+    spin_unlock_irqrestore(&process->threads_lock, flags);
+
+    // Allocations are mapped at their kernel address.
+    for (int i = 0; i < RAOS_MAX_PROGRAM_ALLOCATIONS && !owned; i++) {
+        struct process_allocation* allocation = &process->allocations[i];
+        owned = allocation->ptr
+                && process_range_holds(allocation->ptr,
+                                       allocation->ptr + allocation->size,
+                                       addr, size);
+    }
+
+    return owned;
+}
+
+
 int process_terminate_allocations(struct process* process) {
     for (int i = 0; i < RAOS_MAX_PROGRAM_ALLOCATIONS; i++) {
         process_free(process, process->allocations[i].ptr);
@@ -141,27 +207,23 @@ int process_free_program_data(struct process* process) {
     return res;
 }
 
-void process_switch_to_any() {
-    for (int i = 0; i < RAOS_MAX_PROCESSES; i++) {
-        if (processes[i]) {
-            process_switch(processes[i]);
-            return;
-        }
-    }
-
-
-    panic("No processes to switch too\n");
-}
-
 static void process_unlink(struct process* process) {
     processes[process->id] = 0x00;
 
-    if (current_process == process) {
-        process_switch_to_any();
+    if (process_current() == process) {
+        // The scheduler sets the process of whatever runs next on this CPU.
+        process_switch(0);
     }
 }
 
-int process_terminate(struct process* process) {
+
+/**
+ * @brief Free a process once its last thread exited.
+ *
+ * @param process
+ * @return int
+ */
+static int process_release(struct process* process) {
     int res = 0;
 
     res = process_terminate_allocations(process);
@@ -176,15 +238,272 @@ int process_terminate(struct process* process) {
 
     // Free the process stack memory.
     kfree(process->stack);
-    // Free the task
-    task_free(process->task);
+    // No thread runs on the address space anymore.
+    paging_free_4gb(process->page_directory);
     // Unlink the process from the process array.
     process_unlink(process);
+    kfree(process);
 
 out:
     return res;
 }
 
+
+/**
+ * @brief Terminate all threads of a process. Blocked threads are woken up,
+ *        each thread exits on its way back to user land. Does not return
+ *        when called by a thread of the process itself.
+ *
+ * @param process
+ * @return int
+ */
+int process_terminate(struct process* process) {
+    struct task* current = task_current();
+
+    uint32_t flags = spin_lock_irqsave(&process->threads_lock);
+    process->dying = true;
+    for (int i = 0; i < RAOS_MAX_PROCESS_THREADS; i++) {
+        struct task* task = process->threads[i].task;
+        if (task && task != current) {
+            task_wakeup(task);
+        }
+    }
+    spin_unlock_irqrestore(&process->threads_lock, flags);
+
+    if (current && current->process == process) {
+        process_thread_exit(current, 0);
+    }
+
+    return 0;
+}
+
+
+// The user stack of thread thread_id (> 0) ends a guard page below the one
+// of the previous thread.
+static void* process_thread_stack_top(int thread_id) {
+    return (void*)(RAOS_PROGRAM_VIRTUAL_STACK_ADDRESS_END - PAGING_PAGE_SIZE
+                   - (thread_id - 1)
+                         * (RAOS_USER_PROGRAM_STACK_SIZE + PAGING_PAGE_SIZE));
+}
+
+
+static int process_thread_map_stack(struct process* process, int thread_id,
+                                    void* stack, int flags) {
+    return paging_map_to(
+        process->page_directory,
+        process_thread_stack_top(thread_id) - RAOS_USER_PROGRAM_STACK_SIZE,
+        stack, paging_align_address(stack + RAOS_USER_PROGRAM_STACK_SIZE),
+        flags);
+}
+
+
+/**
+ * @brief Start a thread in the address space of the process. It runs
+ *        entry(arg) on its own user stack and must end with a thread exit,
+ *        entry has nowhere to return to.
+ *
+ * @param process
+ * @param entry user virtual address
+ * @param arg passed on the stack of the thread
+ * @return int the thread id, or a negative status
+ */
+int process_thread_create(struct process* process, void* entry, void* arg) {
+    int       res       = 0;
+    int       thread_id = -1;
+    uint32_t* stack     = kzalloc(RAOS_USER_PROGRAM_STACK_SIZE);
+    if (!stack) {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    // cdecl frame of entry(arg), with a null return address.
+    uint32_t* sp = (uint32_t*)((void*)stack + RAOS_USER_PROGRAM_STACK_SIZE);
+    *--sp        = (uint32_t)arg;
+    *--sp        = 0;
+
+    // The slot is reserved under the lock, the stack is mapped outside of
+    // it: changing present entries waits for the other CPUs running the
+    // process, one of them may spin on the lock with interrupts off.
+    uint32_t flags = spin_lock_irqsave(&process->threads_lock);
+    if (process->dying) {
+        res = -EINTR;
+        goto out_unlock;
+    }
+
+    for (int i = 1; i < RAOS_MAX_PROCESS_THREADS; i++) {
+        if (!process->threads[i].used) {
+            thread_id = i;
+            break;
+        }
+    }
+
+    if (thread_id < 0) {
+        res = -EISTKN;
+        goto out_unlock;
+    }
+
+    process->threads[thread_id] = (struct process_thread){.used = true};
+    spin_unlock_irqrestore(&process->threads_lock, flags);
+
+    res = process_thread_map_stack(process, thread_id, stack,
+                                   PAGING_IS_PRESENT | PAGING_ACCESS_FROM_ALL
+                                       | PAGING_IS_WRITABLE);
+    if (res < 0) {
+        goto out_release;
+    }
+
+    // Held until the thread is in its slot, so even a thread exiting right
+    // away on another CPU finds itself there.
+    flags = spin_lock_irqsave(&process->threads_lock);
+    struct task* task = ERROR(-EINTR);
+    if (!process->dying) {
+        void* esp = process_thread_stack_top(thread_id)
+                    - ((void*)stack + RAOS_USER_PROGRAM_STACK_SIZE - (void*)sp);
+        // A new thread starts where its creator prefers to run.
+        struct task* current = task_current();
+        task = task_new_thread(process, entry, esp,
+                               current ? current->affinity : TASK_AFFINITY_ANY);
+    }
+
+    if (ISERR(task)) {
+        spin_unlock_irqrestore(&process->threads_lock, flags);
+        res = ERROR_I(task);
+        process_thread_map_stack(process, thread_id, stack, 0x00);
+        goto out_release;
+    }
+
+    process->threads[thread_id].task  = task;
+    process->threads[thread_id].stack = stack;
+    process->thread_count++;
+    res = thread_id;
+
+out_unlock:
+    spin_unlock_irqrestore(&process->threads_lock, flags);
+    goto out;
+
+out_release:
+    // Given back only once its stack is unmapped again.
+    flags = spin_lock_irqsave(&process->threads_lock);
+    memset(&process->threads[thread_id], 0, sizeof(struct process_thread));
+    spin_unlock_irqrestore(&process->threads_lock, flags);
+out:
+    if (ISERR(res) && stack) {
+        kfree(stack);
+    }
+    return res;
+}
+
+
+/**
+ * @brief Wait for a thread of the process to exit and free its slot.
+ *
+ * @param process
+ * @param thread_id
+ * @return int the exit code of the thread, or a negative status
+ */
+int process_thread_join(struct process* process, int thread_id) {
+    struct task* current = task_current();
+    if (thread_id < 0 || thread_id >= RAOS_MAX_PROCESS_THREADS) {
+        return -EINVARG;
+    }
+
+    int                    res    = 0;
+    struct process_thread* thread = &process->threads[thread_id];
+    uint32_t               flags  = spin_lock_irqsave(&process->threads_lock);
+    // A reserved slot has no task yet, its id was not handed out.
+    if (!thread->used || (!thread->task && !thread->exited)
+        || thread->task == current || thread->joiner) {
+        res = -EINVARG;
+        goto out;
+    }
+
+    while (!thread->exited) {
+        if (process->dying) {
+            res = -EINTR;
+            goto out;
+        }
+
+        // Blocked under the lock, the exiting thread wakes us after it.
+        thread->joiner = current;
+        flags = task_wait(&process->threads_lock, flags);
+    }
+
+    res = thread->exit_code;
+    memset(thread, 0, sizeof(struct process_thread));
+
+out:
+    if (thread->joiner == current) {
+        thread->joiner = 0;
+    }
+    spin_unlock_irqrestore(&process->threads_lock, flags);
+    return res;
+}
+
+
+/**
+ * @brief End the current thread task. The last thread to exit frees the
+ *        process. Never returns.
+ *
+ * @param task the current task
+ * @param exit_code handed to process_thread_join()
+ */
+void process_thread_exit(struct task* task, uint32_t exit_code) {
+    struct process*        process = task->process;
+    struct process_thread* thread  = 0;
+
+    // Not preempted from here on, a preempted task would be resumed under
+    // its directory again. Off the address space before the last thread
+    // may free it.
+    disable_interrupts();
+    kernel_page();
+
+    uint32_t flags = spin_lock_irqsave(&process->threads_lock);
+    for (int i = 0; i < RAOS_MAX_PROCESS_THREADS; i++) {
+        if (process->threads[i].task == task) {
+            thread = &process->threads[i];
+            break;
+        }
+    }
+
+    if (!thread) {
+        panic("process_thread_exit(): Task is no thread of its process\n");
+    }
+
+    int          thread_id = thread - process->threads;
+    void*        stack     = thread->stack;
+    struct task* joiner    = thread->joiner;
+    thread->task           = 0;
+    thread->stack          = 0;
+    thread->joiner         = 0;
+    thread->exited         = true;
+    thread->exit_code      = exit_code;
+    if (process->task == task) {
+        process->task = 0;
+    }
+    bool last = --process->thread_count == 0;
+    spin_unlock_irqrestore(&process->threads_lock, flags);
+
+    // Unmapping waits until every CPU running the process dropped the
+    // stack from its TLB, a sibling thread can not write to it once freed.
+    if (stack) {
+        process_thread_map_stack(process, thread_id, stack, 0x00);
+        kfree(stack);
+    }
+
+    if (joiner) {
+        task_wakeup(joiner);
+    }
+
+    // Freed by the scheduler once this CPU left the task's kernel stack.
+    task_free(task);
+    if (last) {
+        process_release(process);
+    }
+
+    task_next();
+    panic("process_thread_exit(): Exited thread was scheduled\n");
+}
+
 void process_get_arguments(struct process* process, int* argc, char*** argv) {
     *argc = process->arguments.argc;
     *argv = process->arguments.argv;
@@ -248,7 +567,7 @@ void process_free(struct process* process, void* ptr) {
     }
 
     int res = paging_map_to(
-        process->task->page_directory, allocation->ptr, allocation->ptr,
+        process->page_directory, allocation->ptr, allocation->ptr,
         paging_align_address(allocation->ptr + allocation->size), 0x00);
     if (res < 0) {
         return;
@@ -336,7 +655,7 @@ static int process_load_data(const char* filename, struct process* process) {
 int process_map_binary(struct process* process) {
     int res = 0;
     paging_map_to(
-        process->task->page_directory, (void*)RAOS_PROGRAM_VIRTUAL_ADDRESS,
+        process->page_directory, (void*)RAOS_PROGRAM_VIRTUAL_ADDRESS,
         process->ptr, paging_align_address(process->ptr + process->size),
         PAGING_IS_PRESENT | PAGING_ACCESS_FROM_ALL | PAGING_IS_WRITABLE);
     return res;
@@ -356,7 +675,7 @@ static int process_map_elf(struct process* process) {
             flags |= PAGING_IS_WRITABLE;
         }
         res = paging_map_to(
-            process->task->page_directory,
+            process->page_directory,
             paging_align_to_lower_page((void*)phdr->p_vaddr),
             paging_align_to_lower_page(phdr_phys_address),
             paging_align_address(phdr_phys_address + phdr->p_memsz), flags);
@@ -396,7 +715,7 @@ int process_map_memory(struct process* process) {
 
     // Finally map the stack
     paging_map_to(
-        process->task->page_directory,
+        process->page_directory,
         (void*)RAOS_PROGRAM_VIRTUAL_STACK_ADDRESS_END, process->stack,
         paging_align_address(process->stack + RAOS_USER_PROGRAM_STACK_SIZE),
         PAGING_IS_PRESENT | PAGING_ACCESS_FROM_ALL | PAGING_IS_WRITABLE);
@@ -495,22 +814,34 @@ int process_load_for_slot(const char* filename, struct process** process,
     _process->stack = program_stack_ptr;
     _process->id    = process_slot;
 
-    // === create a task for process
-    task = task_new(_process);
-    if (ERROR_I(task) == 0) {
-        res = ERROR_I(task);
+    // === Map the entire 4GB readonly address space to its self
+    _process->page_directory =
+        paging_new_4gb(PAGING_IS_PRESENT | PAGING_ACCESS_FROM_ALL);
+    if (!_process->page_directory) {
+        res = -EIO;
         goto out;
     }
 
-    // === Link the task to the process
-    _process->task = task;
-
-    // === Map the memory
+    // === Map the memory, before any thread can run in it
     res = process_map_memory(_process);
     if (res < 0) {
         goto out;
     }
 
+    // === create the main thread of the process, in its slot before it runs
+    uint32_t flags = spin_lock_irqsave(&_process->threads_lock);
+    task           = task_new(_process);
+    if (!ISERR(task)) {
+        _process->task       = task;
+        _process->threads[0] = (struct process_thread){.used = true, .task = task};
+        _process->thread_count = 1;
+    }
+    spin_unlock_irqrestore(&_process->threads_lock, flags);
+    if (ISERR(task)) {
+        res = ERROR_I(task);
+        goto out;
+    }
+
     *process = _process;
 
     // Add the process to the array
@@ -518,8 +849,8 @@ int process_load_for_slot(const char* filename, struct process** process,
 
 out:
     if (ISERR(res)) {
-        if (_process && _process->task) {
-            task_free(_process->task);
+        if (_process && _process->page_directory) {
+            paging_free_4gb(_process->page_directory);
         }
 
         // Free the process data
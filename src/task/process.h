@@ -6,6 +6,7 @@
 
 
 #include "../config.h"
+#include "../lock/spinlock.h"
 #include "task.h"
 
 
@@ -30,15 +31,40 @@ struct process_arguments {
     char** argv;
 };
 
+// A thread slot of a process. An exited thread keeps its slot until it is
+// joined, so the exit code can be collected.
+struct process_thread {
+    bool         used;
+    bool         exited;
+    struct task* task;
+    // The physical pointer to the user stack, 0 for the main thread.
+    void*        stack;
+    uint32_t     exit_code;
+    // The thread blocked in process_thread_join() on this one.
+    struct task* joiner;
+};
+
 struct process {
     // The process id
     uint16_t id;
 
     char filename[RAOS_MAX_PATH];
 
-    // The main process task
+    // The main process task, 0 once the main thread exited
     struct task* task;
 
+    // The address space, shared by all threads of the process.
+    struct paging_4gb_chunk* page_directory;
+
+    // Guards threads, thread_count and dying.
+    struct spinlock       threads_lock;
+    struct process_thread threads[RAOS_MAX_PROCESS_THREADS];
+    // Threads not exited yet, the process is freed when the last one exits.
+    int                   thread_count;
+    // Set by process_terminate(), every thread exits on its next way back
+    // to user land.
+    volatile bool         dying;
+
     // The memory (malloc) allocations of the process
     struct process_allocation allocations[RAOS_MAX_PROGRAM_ALLOCATIONS];
 
@@ -76,10 +102,16 @@ struct process* process_current();
 struct process* process_get(int process_id);
 void*           process_malloc(struct process* process, size_t size);
 void            process_free(struct process* process, void* ptr);
+bool            process_owns_address(struct process* process, void* addr,
+                                     size_t size);
 
 void process_get_arguments(struct process* process, int* argc, char*** argv);
 int  process_inject_arguments(struct process*          process,
                               struct command_argument* root_argument);
 int  process_terminate(struct process* process);
 
+int  process_thread_create(struct process* process, void* entry, void* arg);
+int  process_thread_join(struct process* process, int thread_id);
+void process_thread_exit(struct task* task, uint32_t exit_code);
+
 #endif
\ No newline at end of file
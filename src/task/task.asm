@@ -1,65 +1,48 @@
 [BITS 32]
 section .asm
 
-global restore_general_purpose_registers
 global task_return
+global task_context_switch
 global user_registers
 
 ; void task_return(struct registers* regs);
+; struct registers has the interrupt_frame layout, so it is used as the
+; stack to return from: popad for the general-purpose registers, skip
+; vector and error code, iret pops ip, cs, flags, esp and ss.
 task_return:
-    mov ebp, esp
-    ; PUSH THE DATA SEGMENT (SS WILL BE FINE)
-    ; PUSH THE STACK ADDRESS
-    ; PUSH THE FLAGS
-    ; PUSH THE CODE SEGMENT
-    ; PUSH IP
-
-    ; Let's access the structure passed to us
-    mov ebx, [ebp+4]
-    ; push the data/stack selector
-    push dword [ebx+44]
-    ; Push the stack pointer
-    push dword [ebx+40]
-
-    ; Push the flags
-    pushf
-    pop eax
-    or eax, 0x200
-    push eax
-
-    ; Push the code segment
-    push dword [ebx+32]
-
-    ; Push the IP to execute
-    push dword [ebx+28]
+    cli                     ; esp points into the task until iret
+    mov ebx, [esp+4]
 
     ; Setup some segment registers
-    mov ax, [ebx+44]
+    mov ax, [ebx+56]        ; ss, the user data selector
     mov ds, ax
     mov es, ax
     mov fs, ax
     mov gs, ax
 
-    push dword [ebp+4]
-    call restore_general_purpose_registers
-    add esp, 4
+    mov esp, ebx
+    popad
+    add esp, 8              ; vector and error code
 
     ; Let's leave kernel land and execute in user land!
     iretd
-    
-; void restore_general_purpose_registers(struct registers* regs);
-restore_general_purpose_registers:
+
+; void task_context_switch(uint32_t* save_esp, uint32_t esp);
+; Save the callee-saved registers on the current kernel stack and its esp
+; in *save_esp, then resume the context saved at esp the same way.
+task_context_switch:
+    mov eax, [esp+4]
+    mov edx, [esp+8]
     push ebp
-    mov ebp, esp
-    mov ebx, [ebp+8]
-    mov edi, [ebx]
-    mov esi, [ebx+4]
-    mov ebp, [ebx+8]
-    mov edx, [ebx+16]
-    mov ecx, [ebx+20]
-    mov eax, [ebx+24]
-    mov ebx, [ebx+12]
-    add esp, 4
+    push ebx
+    push esi
+    push edi
+    mov [eax], esp
+    mov esp, edx
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
     ret
 
 ; void user_registers()
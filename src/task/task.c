@@ -8,129 +8,776 @@
 #include "../status.h"
 #include "../string/string.h"
 #include "process.h"
+#include "../smp/smp.h"
+#include "../lock/spinlock.h"
+#include "../cpu/cpu.h"
+#include "../timer/timer.h"
+
+
+// Per-CPU run queue. The running task of a CPU (cpu_current()->current_task)
+// stays on its queue, task_next() rotates through the queue round robin.
+struct run_queue {
+    // Guards head, tail, the next/prev links and the current task of the CPU.
+    struct ticketlock lock;
+    struct task*      head;
+    struct task*      tail;
+    volatile int      length;  // read without the lock by stealing CPUs
+    uint32_t          picks;   // only touched by the owning CPU
+};
+
+static struct run_queue run_queues[RAOS_MAX_CPUS] = {
+    [0 ... RAOS_MAX_CPUS - 1] = {.lock = TICKETLOCK_INIT("run_queue")},
+};
+
+static struct task_switch_stats task_switch_stats[RAOS_MAX_CPUS][TASK_SWITCH_MODES];
+
+// The switch in progress on each CPU, from the save on interrupt entry to
+// the next task's return to user land. start is 0 if none.
+static struct {
+    uint64_t start;
+    bool     switched;
+} task_switch_stamps[RAOS_MAX_CPUS];
+
+static const int task_switch_mode =
+    RAOS_TASK_SWITCH_RELOAD_CR3 ? TASK_SWITCH_RELOAD_CR3 : TASK_SWITCH_KEEP_CR3;
+
+_Static_assert(sizeof(struct registers) == sizeof(struct interrupt_frame),
+               "struct registers must match struct interrupt_frame");
+
+int task_init(struct task* task, struct process* process, void* entry,
+              void* stack);
+static void task_enqueue(struct task* task);
+static void task_finish_switch();
+static void task_sleep_timeout(void* data);
 
+struct task* task_current() {
+    // Not moved to another CPU between reading which CPU and its task.
+    uint32_t     flags = cpu_irq_save();
+    struct task* task  = cpu_current()->current_task;
+    cpu_irq_restore(flags);
+    return task;
+}
 
-// The current task that is running
-struct task* current_task = 0;
 
-// Task linked list
-struct task* task_tail = 0;
-struct task* task_head = 0;
+// rq->lock must be held.
+static void run_queue_push(struct run_queue* rq, struct task* task, int cpu) {
+    task->next = 0;
+    task->prev = rq->tail;
+    if (rq->tail) {
+        rq->tail->next = task;
+    } else {
+        rq->head = task;
+    }
+    rq->tail  = task;
+    task->cpu = cpu;
+    rq->length++;
+}
 
-int task_init(struct task* task, struct process* process);
 
-struct task* task_current() {
-    return current_task;
+// rq->lock must be held.
+static void run_queue_remove(struct run_queue* rq, struct task* task) {
+    if (task->prev) {
+        task->prev->next = task->next;
+    }
+
+    if (task->next) {
+        task->next->prev = task->prev;
+    }
+
+    if (task == rq->head) {
+        rq->head = task->next;
+    }
+
+    if (task == rq->tail) {
+        rq->tail = task->prev;
+    }
+
+    task->next = 0;
+    task->prev = 0;
+    task->cpu  = -1;
+    rq->length--;
 }
 
-struct task* task_new(struct process* process) {
+
+/**
+ * @brief The CPU a task is queued on: the CPU holding its FPU state, its
+ *        affinity when that CPU is online, otherwise the online CPU with the
+ *        shortest run queue.
+ *
+ * @param task
+ * @return int
+ */
+static int task_place(struct task* task) {
+    // Its FPU registers are still loaded there.
+    if (task->fpu_cpu >= 0) {
+        return task->fpu_cpu;
+    }
+
+    if (task->affinity != TASK_AFFINITY_ANY && cpu_get(task->affinity)->online) {
+        return task->affinity;
+    }
+
+    int best = cpu_current()->id;
+    for (int i = 0; i < smp_total_cpus(); ++i) {
+        if (cpu_get(i)->online && run_queues[i].length < run_queues[best].length) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+// TASK_AFFINITY_ANY or an online CPU.
+static bool task_affinity_valid(int cpu) {
+    return cpu == TASK_AFFINITY_ANY
+           || (cpu >= 0 && cpu < smp_total_cpus() && cpu_get(cpu)->online);
+}
+
+
+// Whether the task should run on another CPU than cpu.
+static bool task_affinity_elsewhere(struct task* task, int cpu) {
+    return task->affinity != TASK_AFFINITY_ANY && task->affinity != cpu
+           && cpu_get(task->affinity)->online;
+}
+
+
+/**
+ * @brief New runnable task in the address space of a process, it starts
+ *        in user land at entry with esp at stack.
+ *
+ * @param process
+ * @param entry user virtual address
+ * @param stack user virtual address
+ * @param affinity preferred CPU or TASK_AFFINITY_ANY, placed there right away
+ * @return struct task*
+ */
+struct task* task_new_thread(struct process* process, void* entry, void* stack,
+                             int affinity) {
     int          res  = 0;
-    struct task* task = kzalloc(sizeof(struct task));
+    struct task* task = 0;
+    if (!task_affinity_valid(affinity)) {
+        res = -EINVARG;
+        goto out;
+    }
+
+    task = kzalloc(sizeof(struct task));
     if (!task) {
         res = -ENOMEM;
         goto out;
     }
 
-    res = task_init(task, process);
+    res = task_init(task, process, entry, stack);
     if (res != RAOS_ALL_OK) {
         goto out;
     }
 
-    if (task_head == 0) {
-        task_head    = task;
-        task_tail    = task;
-        current_task = task;
+    task->affinity = affinity;
+    task_enqueue(task);
+
+out:
+    if (ISERR(res)) {
+        // Never queued, task_init() frees what it allocated on failure.
+        kfree(task);
+        return ERROR(res);
+    }
+
+    return task;
+}
+
+
+/**
+ * @brief New runnable kernel task, it runs entry(data) in ring 0 with
+ *        interrupts on and may sleep. Preempted like a task in a system call.
+ *
+ * @param entry must not return
+ * @param data
+ * @param affinity preferred CPU or TASK_AFFINITY_ANY
+ * @return struct task*
+ */
+struct task* task_new_kernel(TASK_KERNEL_FUNCTION entry, void* data,
+                             int affinity) {
+    int          res  = 0;
+    struct task* task = 0;
+    if (!task_affinity_valid(affinity)) {
+        res = -EINVARG;
+        goto out;
+    }
+
+    task = kzalloc(sizeof(struct task));
+    if (!task) {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    task->kernel_stack = kmalloc(RAOS_TASK_KERNEL_STACK_SIZE);
+    if (!task->kernel_stack) {
+        res = -ENOMEM;
         goto out;
     }
 
-    task_tail->next = task;
-    task->prev      = task_tail;
-    task_tail       = task;
+    task->kernel_entry = entry;
+    task->kernel_data  = data;
+    task->cpu          = -1;
+    task->affinity     = affinity;
+    task->state        = TASK_STATE_RUNNABLE;
+    task->fpu_cpu      = -1;
+    timer_setup(&task->sleep_timer, task_sleep_timeout, task);
+
+    task_enqueue(task);
 
 out:
     if (ISERR(res)) {
-        task_free(task);
+        if (task) {
+            kfree(task->kernel_stack);
+        }
+        kfree(task);
         return ERROR(res);
     }
 
     return task;
 }
 
+
+// The main thread of a process, at the program entry on the process stack.
+struct task* task_new(struct process* process) {
+    void* entry = (void*)RAOS_PROGRAM_VIRTUAL_ADDRESS;
+    if (process->filetype == PROCESS_FILETYPE_ELF) {
+        entry = (void*)elf_header(process->elf_file)->e_entry;
+    }
+
+    return task_new_thread(process, entry,
+                           (void*)RAOS_PROGRAM_VIRTUAL_STACK_ADDRESS_START,
+                           TASK_AFFINITY_ANY);
+}
+
+/**
+ * @brief Move a task from the busiest neighbour to this CPU and make it the
+ *        current task. The running task of the victim, tasks with an
+ *        affinity for the victim and tasks whose FPU state is live in the
+ *        victim's registers are left alone. Only one queue lock is held
+ *        at a time, so two CPUs stealing from each other cannot deadlock.
+ *
+ * @param rq the run queue of this CPU
+ * @return struct task* the stolen task, 0 when there is nothing to steal
+ */
+static struct task* task_steal(struct run_queue* rq) {
+    struct cpu* cpu    = cpu_current();
+    int         victim = -1;
+    int         most   = rq->length + 1;  // stealing must improve the balance
+    for (int i = 0; i < smp_total_cpus(); ++i) {
+        if (i != cpu->id && run_queues[i].length > most) {
+            victim = i;
+            most   = run_queues[i].length;
+        }
+    }
+
+    if (victim < 0) {
+        return 0;
+    }
+
+    struct run_queue* victim_rq      = &run_queues[victim];
+    struct task*      stolen         = 0;
+    uint32_t          flags          = ticket_lock_irqsave(&victim_rq->lock);
+    struct task*      victim_current = cpu_get(victim)->current_task;
+    // The tail waited the longest since it last ran there, take it first.
+    for (struct task* task = victim_rq->tail; task; task = task->prev) {
+        if (task != victim_current && task->affinity != victim
+            && task->fpu_cpu < 0 && !task->on_cpu) {
+            stolen = task;
+            run_queue_remove(victim_rq, stolen);
+            break;
+        }
+    }
+    ticket_unlock_irqrestore(&victim_rq->lock, flags);
+
+    if (!stolen) {
+        return 0;
+    }
+
+    flags = ticket_lock_irqsave(&rq->lock);
+    run_queue_push(rq, stolen, cpu->id);
+    cpu->current_task = stolen;
+    ticket_unlock_irqrestore(&rq->lock, flags);
+
+    return stolen;
+}
+
+
+/**
+ * @brief Pick the task to run next on this CPU and make it the current task.
+ *        Mostly only the local run queue is touched, a busier neighbour is
+ *        looked at when this CPU runs out of work and every
+ *        RAOS_SCHED_BALANCE_INTERVAL picks.
+ *
+ * @return struct task* 0 when this CPU has nothing to run
+ */
 struct task* task_get_next() {
-    if (!current_task->next) {
-        return task_head;
+    struct cpu*       cpu = cpu_current();
+    struct run_queue* rq  = &run_queues[cpu->id];
+
+    if (rq->length <= 1 || ++rq->picks % RAOS_SCHED_BALANCE_INTERVAL == 0) {
+        struct task* stolen = task_steal(rq);
+        if (stolen) {
+            return stolen;
+        }
     }
 
-    return current_task->next;
+    // The next task is made current under the queue lock, so no other CPU
+    // can steal it between the pick and the switch.
+    uint32_t     flags   = ticket_lock_irqsave(&rq->lock);
+    struct task* current = cpu->current_task;
+    struct task* next    = rq->head;
+    if (current && current->cpu == cpu->id && current->next) {
+        next = current->next;
+    }
+    cpu->current_task = next;
+    ticket_unlock_irqrestore(&rq->lock, flags);
+
+    return next;
 }
 
+
+// Put a task on the run queue task_place() picks for it.
+static void task_enqueue(struct task* task) {
+    int               cpu   = task_place(task);
+    struct run_queue* rq    = &run_queues[cpu];
+    uint32_t          flags = ticket_lock_irqsave(&rq->lock);
+    run_queue_push(rq, task, cpu);
+    ticket_unlock_irqrestore(&rq->lock, flags);
+
+    cpu_wakeup(cpu_get(cpu));
+}
+
+
 /**
- * @brief
+ * @brief Change the preferred CPU of a task. A task waiting on a run queue
+ *        moves there now, a running one at its next switch (see
+ *        task_schedule()), a blocked one when it wakes up. A task whose FPU
+ *        state is live on another CPU than the running one waits until it
+ *        runs there again and gives it up.
  *
  * @param task
+ * @param cpu an online CPU or TASK_AFFINITY_ANY
+ * @return int
  */
-static void task_list_remove(struct task* task) {
-    if (task->prev) {
-        task->prev->next = task->next;
+int task_set_affinity(struct task* task, int cpu) {
+    if (!task_affinity_valid(cpu)) {
+        return -EINVARG;
     }
 
-    if (task->next) {
-        task->next->prev = task->prev;
+    task->affinity = cpu;
+    if (!task_affinity_elsewhere(task, task->cpu) || task->fpu_cpu >= 0) {
+        return 0;
     }
 
-    if (task == task_head) {
-        task_head = task->next;
+    int queue = task->cpu;
+    if (queue < 0) {
+        return 0;
     }
 
-    if (task == task_tail) {
-        task_tail = task->prev;
+    // Taken off under the lock only while no CPU runs it.
+    struct run_queue* rq    = &run_queues[queue];
+    bool              moved = false;
+    uint32_t          flags = ticket_lock_irqsave(&rq->lock);
+    if (task->cpu == queue && task->state == TASK_STATE_RUNNABLE && !task->on_cpu
+        && cpu_get(queue)->current_task != task) {
+        run_queue_remove(rq, task);
+        moved = true;
     }
+    ticket_unlock_irqrestore(&rq->lock, flags);
 
-    if (task == current_task) {
-        current_task = task_get_next();
+    if (moved) {
+        task_enqueue(task);
     }
+
+    return 0;
 }
 
+/**
+ * @brief Unlink a task from its run queue.
+ *
+ * @param task
+ */
+static void task_list_remove(struct task* task) {
+    // The task may be in flight between two queues, wait for it to land.
+    while (task->state == TASK_STATE_RUNNABLE) {
+        int cpu = task->cpu;
+        if (cpu < 0) {
+            cpu_pause();
+            continue;
+        }
+
+        struct run_queue* rq    = &run_queues[cpu];
+        uint32_t          flags = ticket_lock_irqsave(&rq->lock);
+        if (task->cpu == cpu) {
+            run_queue_remove(rq, task);
+            if (cpu_get(cpu)->current_task == task) {
+                cpu_get(cpu)->current_task = 0;
+            }
+            ticket_unlock_irqrestore(&rq->lock, flags);
+            break;
+        }
+        ticket_unlock_irqrestore(&rq->lock, flags);
+    }
+}
+
+/**
+ * @brief Take a task off the run queues until task_wakeup(). A task blocking
+ *        itself calls task_next() next.
+ *
+ * @param task
+ */
+void task_block(struct task* task) {
+    task_list_remove(task);
+    task->state = TASK_STATE_BLOCKED;
+}
+
+
+/**
+ * @brief Make a blocked task runnable again, safe from interrupt context.
+ *
+ * @param task
+ */
+void task_wakeup(struct task* task) {
+    if (!__sync_bool_compare_and_swap(&task->state, TASK_STATE_BLOCKED,
+                                      TASK_STATE_RUNNABLE)) {
+        return;
+    }
+
+    task_enqueue(task);
+}
+
+
+/**
+ * @brief Sleep on a wait queue guarded by lock. The caller holds the lock,
+ *        irqsave'd into flags, and made the current task findable by its
+ *        waker under it, so a wakeup can not slip in before the block. A
+ *        waiter record the caller keeps on its kernel stack stays valid
+ *        until this returns, with the lock held again.
+ *
+ * @param lock
+ * @param flags of spin_lock_irqsave(lock)
+ * @return uint32_t the flags to restore with the lock
+ */
+uint32_t task_wait(struct spinlock* lock, uint32_t flags) {
+    task_block(task_current());
+    spin_unlock_irqrestore(lock, flags);
+    task_next();
+    return spin_lock_irqsave(lock);
+}
+
+
+static void task_sleep_timeout(void* data) {
+    task_wakeup((struct task*)data);
+}
+
+
+/**
+ * @brief Block the current task for ms milliseconds and run other tasks on
+ *        this CPU meanwhile. Returns on the task's kernel stack once it is
+ *        woken up and scheduled again.
+ *
+ * @param ms
+ */
+void task_sleep(uint32_t ms) {
+    struct task* task = task_current();
+    if (!task) {
+        panic("task_sleep(): No current task\n");
+    }
+
+    // Not preempted while blocked with the timer not armed yet.
+    uint32_t flags = cpu_irq_save();
+    task_block(task);
+    // Armed after the task left its run queue, so the wakeup cannot be lost.
+    timer_add(&task->sleep_timer, ms);
+    task_next();
+    cpu_irq_restore(flags);
+}
+
+
 int task_free(struct task* task) {
-    paging_free_4gb(task->page_directory);
+    timer_cancel(&task->sleep_timer);
+    fpu_task_free(task);
     task_list_remove(task);
 
+    // Still running on its kernel stack, task_finish_switch() frees it once
+    // this CPU is off it.
+    struct cpu* cpu = cpu_current();
+    if (cpu->running_task == task) {
+        cpu->dead_task = task;
+        return 0;
+    }
+
     // Finally free the task data
+    kfree(task->kernel_stack);
     kfree(task);
     return 0;
 }
 
-void task_next() {
-    struct task* next_task = task_get_next();
-    if (!next_task) {
-        panic("No more tasks!\n");
+// Account the switch started by task_current_save_stat() on this CPU, an
+// interrupt that did not switch is no switch.
+static void task_switch_stats_end() {
+    int id = cpu_current()->id;
+    if (!task_switch_stamps[id].start || !task_switch_stamps[id].switched) {
+        return;
+    }
+
+    struct task_switch_stats* stats = &task_switch_stats[id][task_switch_mode];
+    uint32_t cycles = (uint32_t)(cpu_rdtsc() - task_switch_stamps[id].start);
+    task_switch_stamps[id].start = 0;
+    if (!stats->count || cycles < stats->min_cycles) {
+        stats->min_cycles = cycles;
+    }
+    if (cycles > stats->max_cycles) {
+        stats->max_cycles = cycles;
+    }
+    stats->total_cycles += cycles;
+    stats->count++;
+}
+
+
+static void task_switch_stats_cancel() {
+    task_switch_stamps[cpu_current()->id].start = 0;
+}
+
+
+void task_print_switch_stats() {
+    static const char* mode_names[TASK_SWITCH_MODES] = {"keep", "reload"};
+
+    char buf[16];
+    print("cpu cr3 switches min/avg/max cycles\n");
+    for (int i = 0; i < smp_total_cpus(); ++i) {
+        for (int mode = 0; mode < TASK_SWITCH_MODES; ++mode) {
+            struct task_switch_stats* stats = &task_switch_stats[i][mode];
+            if (!stats->count) {
+                continue;
+            }
+
+            print(uitoa(i, buf, 10));
+            print(" ");
+            print(mode_names[mode]);
+            print(" ");
+            print(uitoa(stats->count, buf, 10));
+            print(" ");
+            print(uitoa(stats->min_cycles, buf, 10));
+            print("/");
+            print(uitoa(cpu_div_u64_u32(stats->total_cycles, stats->count),
+                        buf, 10));
+            print("/");
+            print(uitoa(stats->max_cycles, buf, 10));
+            print("\n");
+        }
     }
+}
+
 
-    task_switch(next_task);
-    task_return(&next_task->registers);
+// Fixed at build time, see RAOS_TASK_SWITCH_RELOAD_CR3.
+int task_get_switch_mode() {
+    return task_switch_mode;
+}
+
+
+/**
+ * @brief First code a task runs in the kernel, task_context_switch() returns
+ *        here for a task without kernel context. Leaves for user land.
+ *
+ */
+static void task_first_run() {
+    task_finish_switch();
+
+    struct task* task = task_current();
+    cpu_current()->irq_depth = 0;
+    task_switch(task);
+    task_switch_stats_end();
+    task_return(&task->registers);
+}
+
+
+// First code of a kernel task, task_first_run() of task_new_kernel().
+static void task_kernel_first_run() {
+    task_finish_switch();
+    cpu_current()->irq_depth = 0;
+
+    struct task* task = task_current();
+    enable_interrupts();
+    task->kernel_entry(task->kernel_data);
+    panic("task_kernel_first_run(): Kernel task returned\n");
+}
+
+
+/**
+ * @brief Kernel context of a task that never ran: task_first_run() with
+ *        zeroed callee-saved registers, at the top of its kernel stack.
+ *
+ * @param task
+ * @return uint32_t esp for task_context_switch()
+ */
+static uint32_t task_first_context(struct task* task) {
+    uint32_t* sp = (uint32_t*)(task->kernel_stack + RAOS_TASK_KERNEL_STACK_SIZE);
+    *--sp = 0;                         // task_first_run() never returns
+    // ret of task_context_switch()
+    *--sp = (uint32_t)(task->kernel_entry ? task_kernel_first_run : task_first_run);
+    for (int i = 0; i < 4; ++i) {
+        *--sp = 0;  // ebp, ebx, esi, edi
+    }
+
+    return (uint32_t)sp;
+}
+
+
+/**
+ * @brief Second half of a switch, on the stack of the context switched to.
+ *        The previous task may now be run (and stolen) elsewhere, an exited
+ *        one is freed.
+ *
+ */
+static void task_finish_switch() {
+    struct cpu* cpu = cpu_current();
+    if (cpu->switch_prev) {
+        cpu->switch_prev->on_cpu = false;
+        cpu->switch_prev         = 0;
+    }
+
+    if (cpu->dead_task && cpu->dead_task != cpu->running_task) {
+        kfree(cpu->dead_task->kernel_stack);
+        kfree(cpu->dead_task);
+        cpu->dead_task = 0;
+    }
+}
+
+
+/**
+ * @brief Give this CPU to the next runnable task, interrupts must be off.
+ *        The current task keeps its kernel context on its own stack and
+ *        returns from here when it is scheduled again, a task that blocked
+ *        or exited is simply not picked. Without a runnable task the CPU
+ *        goes back to its idle context.
+ *
+ * @return true if the CPU ran another context before returning
+ */
+static bool task_schedule() {
+    struct cpu*  cpu  = cpu_current();
+    struct task* prev = cpu->running_task;
+    // A running task moves to the CPU of its new affinity at its switch,
+    // with its FPU state saved so it can be loaded there.
+    if (prev && prev->state == TASK_STATE_RUNNABLE && prev->cpu == cpu->id
+        && task_affinity_elsewhere(prev, cpu->id)) {
+        fpu_release(prev);
+        task_list_remove(prev);
+        task_enqueue(prev);
+    }
+
+    struct task* next = task_get_next();
+
+    if (next == prev) {
+        // Nothing else to run, keep going, or stay idle.
+        task_switch_stats_cancel();
+        if (!next) {
+            return false;
+        }
+
+        process_switch(next->process);
+        fpu_switch(next);
+        return false;
+    }
+
+    uint32_t  esp  = cpu->idle_esp;
+    uint32_t* save = prev ? &prev->kernel_esp : &cpu->idle_esp;
+    if (next) {
+        // Woken up while its old CPU is still leaving its stack.
+        while (next->on_cpu) {
+            cpu_pause();
+        }
+
+        next->on_cpu  = true;
+        esp           = next->kernel_esp ? next->kernel_esp : task_first_context(next);
+        next->kernel_esp = 0;
+        cpu->tss.esp0 = (uint32_t)next->kernel_stack + RAOS_TASK_KERNEL_STACK_SIZE;
+        cpu->idle     = false;
+        process_switch(next->process);
+        fpu_switch(next);
+        // The kernel is mapped in every directory, so it goes on under the
+        // next task's and returns to user land without another reload.
+        if (next->page_directory) {
+            paging_switch(next->page_directory);
+        } else {
+            kernel_page();
+        }
+        task_switch_stamps[cpu->id].switched = true;
+    } else {
+        // Idle time is no switch. Idle runs under the kernel's directory,
+        // one that is freed is never left loaded.
+        task_switch_stats_cancel();
+        kernel_page();
+    }
+
+    // The interrupt nesting belongs to the context, a preempted task goes
+    // on in its interrupt handler, maybe on another CPU.
+    int irq_depth = cpu->irq_depth;
+
+    cpu->switch_prev  = prev;
+    cpu->running_task = next;
+    task_context_switch(save, esp);
+
+    // Back on this task's (or the idle) stack.
+    cpu_current()->irq_depth = irq_depth;
+    task_finish_switch();
+    return true;
+}
+
+
+void task_next() {
+    uint32_t flags = cpu_irq_save();
+    task_schedule();
+    cpu_irq_restore(flags);
+}
+
+
+/**
+ * @brief Run loop of a CPU without a runnable task. Halts with the periodic
+ *        tick stopped until an interrupt (a timer, cpu_wakeup()) and looks
+ *        for work again. The calling stack becomes the idle context of the
+ *        CPU, task_next() returns here whenever the CPU runs out of tasks.
+ *        Never returns.
+ *
+ */
+void task_idle() {
+    struct cpu* cpu = cpu_current();
+    while (1) {
+        disable_interrupts();
+        timer_idle_exit();
+
+        // Set before looking, so a CPU queuing work afterwards wakes us up.
+        cpu->idle = true;
+        __sync_synchronize();
+        // Back from running tasks, look again with idle set.
+        if (task_schedule()) {
+            continue;
+        }
+
+        timer_idle_enter();
+        cpu_sti_halt();
+    }
 }
 
 // switch current task page directory
 int task_switch(struct task* task) {
-    current_task = task;
+    cpu_current()->current_task = task;
+    process_switch(task->process);
+    fpu_switch(task);
     // asm
     paging_switch(task->page_directory);
     return 0;
 }
 
-void task_save_state(struct task* task, struct interrupt_frame* frame) {
-    task->registers.ip    = frame->ip;
-    task->registers.cs    = frame->cs;
-    task->registers.flags = frame->flags;
-    task->registers.esp   = frame->esp;
-    task->registers.ss    = frame->ss;
-    task->registers.eax   = frame->eax;
-    task->registers.ebp   = frame->ebp;
-    task->registers.ebx   = frame->ebx;
-    task->registers.ecx   = frame->ecx;
-    task->registers.edi   = frame->edi;
-    task->registers.edx   = frame->edx;
-    task->registers.esi   = frame->esi;
+// Back to the directory this CPU runs under, see task_schedule().
+static void task_running_page() {
+    struct task* running = cpu_current()->running_task;
+    if (running && running->page_directory) {
+        paging_switch(running->page_directory);
+    } else {
+        kernel_page();
+    }
 }
 
 int copy_string_from_task(struct task* task, void* virtual, void* phys,
@@ -150,9 +797,12 @@ int copy_string_from_task(struct task* task, void* virtual, void* phys,
     uint32_t  old_entry      = paging_get(task_directory, tmp);
     paging_map(task->page_directory, tmp, tmp,
                PAGING_IS_WRITABLE | PAGING_IS_PRESENT | PAGING_ACCESS_FROM_ALL);
+    // A preempted task resumes under its own directory, not the one lent.
+    uint32_t flags = cpu_irq_save();
     paging_switch(task->page_directory);
     strncpy(tmp, virtual, max);
-    kernel_page();
+    task_running_page();
+    cpu_irq_restore(flags);
 
     res = paging_set(task_directory, tmp, old_entry);
     if (res < 0) {
@@ -175,7 +825,10 @@ void task_current_save_stat(struct interrupt_frame *frame) {
     }
 
     struct task* task = task_current();
-    task_save_state(task, frame);
+    task_switch_stamps[cpu_current()->id].start    = cpu_rdtsc();
+    task_switch_stamps[cpu_current()->id].switched = false;
+    // No copy, the frame stays on the kernel stack until the iret.
+    task->frame = frame;
 }
 
 
@@ -186,13 +839,8 @@ void task_current_save_stat(struct interrupt_frame *frame) {
  */
 int task_page() {
     user_registers();
-    task_switch(current_task);
-    return 0;
-}
-
-int task_page_task(struct task* task) {
-    user_registers();
-    paging_switch(task->page_directory);
+    task_switch(task_current());
+    task_switch_stats_end();
     return 0;
 }
 
@@ -201,49 +849,62 @@ int task_page_task(struct task* task) {
  *
  */
 void task_run_first_ever_task() {
-    if (!current_task) {
+    int total = 0;
+    for (int i = 0; i < smp_total_cpus(); ++i) {
+        total += run_queues[i].length;
+    }
+
+    if (!total) {
         panic("task_run_first_ever_task(): No current task exists!\n");
     }
 
-    task_switch(task_head);
-    task_return(&task_head->registers);
+    // The caller's stack becomes the idle context.
+    task_idle();
 }
 
-int task_init(struct task* task, struct process* process) {
+int task_init(struct task* task, struct process* process, void* entry,
+              void* stack) {
     memset(task, 0, sizeof(struct task));
-    // Map the entire 4GB readonly address space to its self
-    task->page_directory =
-        paging_new_4gb(PAGING_IS_PRESENT | PAGING_ACCESS_FROM_ALL);
-    if (!task->page_directory) {
-        return -EIO;
-    }
+    task->page_directory = process->page_directory;
 
-    task->registers.ip = RAOS_PROGRAM_VIRTUAL_ADDRESS;
-    if (process->filetype == PROCESS_FILETYPE_ELF) {
-        task->registers.ip = elf_header(process->elf_file)->e_entry;
+    task->kernel_stack = kmalloc(RAOS_TASK_KERNEL_STACK_SIZE);
+    if (!task->kernel_stack) {
+        return -ENOMEM;
     }
 
-    task->registers.ss  = USER_DATA_SEGMENT;
-    task->registers.cs  = USER_CODE_SEGMENT;
-    task->registers.esp = RAOS_PROGRAM_VIRTUAL_STACK_ADDRESS_START;
+    task->registers.ip    = (uint32_t)entry;
+    task->registers.ss    = USER_DATA_SEGMENT;
+    task->registers.cs    = USER_CODE_SEGMENT;
+    task->registers.esp   = (uint32_t)stack;
+    task->registers.flags = TASK_INITIAL_EFLAGS;
 
-    task->process = process;
+    task->process  = process;
+    task->cpu      = -1;
+    task->affinity = TASK_AFFINITY_ANY;
+    task->state    = TASK_STATE_RUNNABLE;
+    task->fpu_cpu  = -1;
+    timer_setup(&task->sleep_timer, task_sleep_timeout, task);
 
     return 0;
 }
 
 void* task_get_stack_item(struct task* task, int index) {
     void* result = 0;
+    if (!task->frame) {
+        return 0;
+    }
 
-    uint32_t* sp_ptr = (uint32_t*)task->registers.esp;
+    uint32_t* sp_ptr = (uint32_t*)task->frame->esp;
 
-    // Switch to the given tasks page
-    task_page_task(task);
+    // Switch to the given tasks page, not preempted meanwhile
+    uint32_t flags = cpu_irq_save();
+    paging_switch(task->page_directory);
 
     result = (void*)sp_ptr[index];
 
-    // Switch back to the kernel page
-    kernel_page();
+    // Switch back to the page of the task running here
+    task_running_page();
+    cpu_irq_restore(flags);
 
     return result;
 }
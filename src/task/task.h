@@ -4,53 +4,138 @@
 #include "../config.h"
 #include "../idt/idt.h"
 #include "../memory/paging/paging.h"
+#include "../timer/wheel.h"
+#include "../cpu/fpu.h"
 
 struct process;
+struct spinlock;
 
+// Same layout as struct interrupt_frame, so task_return() starts a task with
+// popad and iret straight from here.
 struct registers {
-    //  general-purpose registers
+    //  general-purpose registers, in pushad order
     uint32_t edi;
     uint32_t esi;
     uint32_t ebp;
+    uint32_t reserved;  // skipped by popad
     uint32_t ebx;
     uint32_t edx;
     uint32_t ecx;
     uint32_t eax;
 
+    uint32_t vector;      // unused, keeps the frame layout
+    uint32_t error_code;  // unused, keeps the frame layout
+
     uint32_t ip;  // PC program counter register
     uint32_t cs;  //  code segment register
     uint32_t flags;  // flags register 
     uint32_t esp;  // stack pointer register
     uint32_t ss;  // stack segment register
+} __attribute__((packed));
+
+// Interrupts on, bit 1 is always set.
+#define TASK_INITIAL_EFLAGS 0x202
+
+// Cycles from saving a task on interrupt entry to resuming the next one.
+struct task_switch_stats {
+    uint32_t count;
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint64_t total_cycles;
+};
+
+// How an interrupt from user land treats CR3, see RAOS_TASK_SWITCH_RELOAD_CR3.
+enum TaskSwitchMode {
+    TASK_SWITCH_KEEP_CR3,    // the task's directory stays loaded
+    TASK_SWITCH_RELOAD_CR3,  // the kernel's on entry, the task's on exit
+    TASK_SWITCH_MODES,
 };
 
 
+enum TaskState {
+    TASK_STATE_RUNNABLE,  // on a run queue
+    TASK_STATE_BLOCKED,   // off the run queues until task_wakeup()
+};
+
+// Body of a kernel task, must not return.
+typedef void (*TASK_KERNEL_FUNCTION)(void* data);
+
+// No preferred CPU, the scheduler places the task on the least loaded one.
+#define TASK_AFFINITY_ANY -1
+
 struct task {
-    // The page directory of the task
+    // The page directory of the process, shared by all of its threads. 0
+    // for a kernel task, it runs under the kernel's.
     struct paging_4gb_chunk* page_directory;
 
-    // The registers of the task when the task is not running
+    // Registers of the first run only, task_first_run() leaves with them.
     struct registers registers;
 
-    // The next task in the linked list
+    // User land registers pushed on the kernel stack by the last interrupt
+    // from user land, valid while the task is in the kernel on its behalf.
+    struct interrupt_frame* frame;
+
+    // The next task in the run queue
     struct task* next;
 
-    // Previous task in the linked list
+    // Previous task in the run queue
     struct task* prev;
 
-    // The process of the task
+    // Run queue (CPU id) the task is on, -1 while it is moved between queues.
+    volatile int cpu;
+
+    // Preferred CPU or TASK_AFFINITY_ANY. A hint: placement honours it and
+    // stealing leaves the task on that CPU.
+    int affinity;
+
+    volatile int state;
+
+    // Wakes the task up at the end of task_sleep().
+    struct timer sleep_timer;
+
+    // Kernel stack, RAOS_TASK_KERNEL_STACK_SIZE bytes. While the task is
+    // switched out kernel_esp holds its kernel context (task_context_switch),
+    // 0 before it ever ran. on_cpu while a CPU still executes on the stack.
+    void*         kernel_stack;
+    uint32_t      kernel_esp;
+    volatile bool on_cpu;
+
+    // FPU/SSE registers, saved lazily: only when another task uses the FPU
+    // of the CPU that holds them (fpu_cpu, -1 when they are in fpu).
+    struct fpu_state fpu;
+    bool             fpu_used;
+    volatile int     fpu_cpu;
+
+    // The process of the task, 0 for a kernel task
     struct process* process;
+
+    // What a kernel task runs instead of user land, see task_new_kernel().
+    TASK_KERNEL_FUNCTION kernel_entry;
+    void*                kernel_data;
 };
 
 
 struct task* task_new(struct process* process);
+struct task* task_new_thread(struct process* process, void* entry, void* stack,
+                             int affinity);
+struct task* task_new_kernel(TASK_KERNEL_FUNCTION entry, void* data,
+                             int affinity);
 struct task* task_current();
 struct task* task_get_next();
 int task_free(struct task* task);
+int task_set_affinity(struct task* task, int cpu);
+void task_idle();
+
+void task_block(struct task* task);
+void task_wakeup(struct task* task);
+uint32_t task_wait(struct spinlock* lock, uint32_t flags);
+void task_sleep(uint32_t ms);
+
+void task_print_switch_stats();
+int  task_get_switch_mode();
 
 int task_switch(struct task* task);
 int task_page();
-int task_page_task(struct task* task);
 
 void task_run_first_ever_task();
 
@@ -66,7 +151,7 @@ void task_next();
 
 //  leave kernel land and execute in user land
 void task_return(struct registers* regs);
-void restore_general_purpose_registers(struct registers* regs);
+void task_context_switch(uint32_t* save_esp, uint32_t esp);
 void user_registers();
 
 #endif
\ No newline at end of file
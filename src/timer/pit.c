@@ -0,0 +1,46 @@
+#include "pit.h"
+#include "../io/io.h"
+
+
+#define PIT_CHANNEL0 0x40
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND 0x43
+
+// Keyboard controller port B, bit 0: channel 2 gate, bit 1: speaker,
+// bit 5: channel 2 output.
+#define PIT_CHANNEL2_GATE_PORT 0x61
+
+
+/**
+ * @brief Fire IRQ0 hz times per second.
+ *
+ * @param hz
+ */
+void pit_set_periodic(int hz) {
+    unsigned int divisor = PIT_FREQUENCY / hz;
+
+    outb(PIT_COMMAND, 0x36);  // channel 0, lobyte/hibyte, mode 3 square wave
+    outb(PIT_CHANNEL0, divisor & 0xff);
+    outb(PIT_CHANNEL0, (divisor >> 8) & 0xff);
+}
+
+
+void pit_oneshot_start(int ms) {
+    unsigned int count = (PIT_FREQUENCY / 1000) * ms;
+
+    // Gate low and speaker off while the counter is loaded.
+    unsigned char gate = insb(PIT_CHANNEL2_GATE_PORT) & ~0x03;
+    outb(PIT_CHANNEL2_GATE_PORT, gate);
+
+    outb(PIT_COMMAND, 0xB0);  // channel 2, lobyte/hibyte, mode 0 one-shot
+    outb(PIT_CHANNEL2, count & 0xff);
+    outb(PIT_CHANNEL2, (count >> 8) & 0xff);
+
+    // Gate high, start counting down.
+    outb(PIT_CHANNEL2_GATE_PORT, gate | 0x01);
+}
+
+
+bool pit_oneshot_expired() {
+    return insb(PIT_CHANNEL2_GATE_PORT) & 0x20;
+}
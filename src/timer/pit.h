@@ -0,0 +1,16 @@
+#ifndef _PIT_H
+#define _PIT_H
+
+#include <stdbool.h>
+
+// https://wiki.osdev.org/Programmable_Interval_Timer
+#define PIT_FREQUENCY 1193182
+
+void pit_set_periodic(int hz);
+
+// Busy wait helpers on channel 2, used to calibrate other timers.
+// ms must be at most 54.
+void pit_oneshot_start(int ms);
+bool pit_oneshot_expired();
+
+#endif
@@ -0,0 +1,135 @@
+#include "timer.h"
+#include "../apic/apic.h"
+#include "../idt/idt.h"
+#include "../idt/irq.h"
+#include "../smp/smp.h"
+#include "../task/task.h"
+#include "pit.h"
+#include "wheel.h"
+
+
+static volatile uint32_t ticks = 0;
+
+// CPUs sleeping in task_idle() on a one-shot local APIC timer.
+static bool timer_tickless[RAOS_MAX_CPUS];
+
+// Part of a tick the bootstrap processor slept, carried to its next sleep.
+static uint32_t timer_idle_remainder_ms = 0;
+
+
+uint32_t timer_ticks() {
+    return ticks;
+}
+
+
+/**
+ * @brief Scheduling tick. A task interrupted in user land or in a system
+ *        call is preempted, task_next() returns on its kernel stack when it
+ *        runs again.
+ *
+ * @param frame
+ */
+static void timer_interrupt_handler(struct interrupt_frame* frame) {
+    // The one-shot of an idle CPU, timer_idle_exit() accounts for the sleep.
+    if (timer_tickless[cpu_current()->id]) {
+        return;
+    }
+
+    // Every CPU ticks, the time base is the bootstrap processor's.
+    if (cpu_current()->id == 0) {
+        ticks++;
+        timer_wheel_run(ticks);
+    }
+
+    bool from_user = (frame->cs & 0x03) == 0x03;
+    if (from_user ? task_current() != 0 : idt_preemptible()) {
+        task_next();
+    }
+}
+
+
+/**
+ * @brief Tick RAOS_TIMER_HZ times per second, from the local APIC timer
+ *        when apic_init() succeeded, from the PIT otherwise.
+ *
+ */
+void timer_init() {
+    int vector = IRQ_VECTOR_BASE + IRQ_TIMER;
+    idt_register_interrupt_callback(vector, timer_interrupt_handler);
+
+    if (apic_is_enabled()) {
+        apic_timer_start(vector, RAOS_TIMER_HZ);
+        return;
+    }
+
+    pit_set_periodic(RAOS_TIMER_HZ);
+    irq_unmask(IRQ_TIMER);
+}
+
+
+/**
+ * @brief Stop the periodic tick of an idle CPU, interrupts must be off. The
+ *        bootstrap processor sleeps until the next timer of the wheel, the
+ *        others RAOS_TICKLESS_MAX_IDLE_MS at most. With the PIT the tick
+ *        keeps going, its one-shot is too short to be worth it.
+ *
+ */
+void timer_idle_enter() {
+    struct cpu* cpu = cpu_current();
+    if (!apic_is_enabled()) {
+        return;
+    }
+
+    uint32_t ms   = RAOS_TICKLESS_MAX_IDLE_MS;
+    uint32_t next = 0;
+    if (cpu->id == 0 && timer_wheel_next_expiry(&next)
+        && next < RAOS_TICKLESS_MAX_IDLE_MS / TIMER_MS_PER_TICK) {
+        ms = next * TIMER_MS_PER_TICK;
+    }
+
+    // Due within a tick anyway.
+    if (ms <= TIMER_MS_PER_TICK) {
+        return;
+    }
+
+    // Only the bootstrap processor carries a remainder, see timer_idle_exit().
+    if (cpu->id == 0) {
+        ms -= timer_idle_remainder_ms;
+    }
+
+    timer_tickless[cpu->id] = true;
+    apic_timer_oneshot(IRQ_VECTOR_BASE + IRQ_TIMER, ms);
+}
+
+
+/**
+ * @brief Back to the periodic tick after timer_idle_enter(), interrupts must
+ *        be off. The bootstrap processor adds the ticks it slept through and
+ *        expires the timers that came due meanwhile.
+ *
+ */
+void timer_idle_exit() {
+    struct cpu* cpu = cpu_current();
+    if (!timer_tickless[cpu->id]) {
+        return;
+    }
+
+    uint32_t slept_ms = apic_timer_elapsed_ms();
+    apic_timer_start(IRQ_VECTOR_BASE + IRQ_TIMER, RAOS_TIMER_HZ);
+    timer_tickless[cpu->id] = false;
+
+    if (cpu->id != 0) {
+        return;
+    }
+
+    slept_ms += timer_idle_remainder_ms;
+    ticks += slept_ms / TIMER_MS_PER_TICK;
+    timer_idle_remainder_ms = slept_ms % TIMER_MS_PER_TICK;
+    timer_wheel_run(ticks);
+}
+
+
+// Local APIC timer of an application processor.
+void timer_ap_init() {
+    apic_timer_start(IRQ_VECTOR_BASE + IRQ_TIMER, RAOS_TIMER_HZ);
+}
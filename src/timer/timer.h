@@ -0,0 +1,17 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <stdint.h>
+
+#include "../config.h"
+
+#define TIMER_MS_PER_TICK (1000 / RAOS_TIMER_HZ)
+
+void     timer_init();
+void     timer_ap_init();
+uint32_t timer_ticks();
+
+void timer_idle_enter();
+void timer_idle_exit();
+
+#endif
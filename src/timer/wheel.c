@@ -0,0 +1,237 @@
+#include "wheel.h"
+#include "../lock/spinlock.h"
+#include "timer.h"
+#include "../smp/smp.h"
+
+
+static struct timer* timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+// The next tick timer_wheel_run() processes, timers never expire before it.
+static uint32_t timer_wheel_now = 1;
+
+// Timers are added from every CPU and expire in the tick of the bootstrap
+// processor.
+static struct spinlock timer_wheel_lock = SPINLOCK_INIT("timer_wheel");
+
+
+static uint32_t timer_ms_to_ticks(uint32_t ms) {
+    uint32_t total = (ms + TIMER_MS_PER_TICK - 1) / TIMER_MS_PER_TICK;
+    if (total == 0) {
+        total = 1;
+    }
+
+    if (total > TIMER_WHEEL_MAX_TICKS) {
+        total = TIMER_WHEEL_MAX_TICKS;
+    }
+
+    return total;
+}
+
+
+/**
+ * @brief Link a timer into the slot its distance to timer_wheel_now falls
+ *        in. timer_wheel_lock must be held.
+ *
+ * @param timer
+ */
+static void timer_wheel_insert(struct timer* timer) {
+    uint32_t delta = timer->expires - timer_wheel_now;
+    if ((int32_t)delta < 0) {
+        // Already due, run on the next tick.
+        timer->expires = timer_wheel_now;
+        delta          = 0;
+    }
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1
+           && delta >= (1u << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    int            slot = (timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    struct timer** head = &timer_wheel[level][slot];
+
+    timer->next = *head;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    *head        = timer;
+}
+
+
+// timer_wheel_lock must be held.
+static void timer_wheel_unlink(struct timer* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+
+    timer->next    = 0;
+    timer->pprev   = 0;
+    timer->pending = false;
+}
+
+
+/**
+ * @brief Move the timers of one slot of a higher level to the lower levels.
+ *        timer_wheel_lock must be held.
+ *
+ * @param level
+ * @param slot
+ * @return int the slot, 0 means the next level is due as well
+ */
+static int timer_wheel_cascade(int level, int slot) {
+    struct timer* timer       = timer_wheel[level][slot];
+    timer_wheel[level][slot] = 0;
+
+    while (timer) {
+        struct timer* next = timer->next;
+        timer_wheel_insert(timer);
+        timer = next;
+    }
+
+    return slot;
+}
+
+
+void timer_setup(struct timer* timer, TIMER_CALLBACK_FUNCTION function,
+                 void* data) {
+    timer->function = function;
+    timer->data     = data;
+    timer->next     = 0;
+    timer->pprev    = 0;
+    timer->pending  = false;
+}
+
+
+/**
+ * @brief Call timer->function ms milliseconds from now, in interrupt
+ *        context on the bootstrap processor. Re-arms a pending timer.
+ *
+ * @param timer set up by timer_setup()
+ * @param ms
+ */
+void timer_add(struct timer* timer, uint32_t ms) {
+    uint32_t flags = spin_lock_irqsave(&timer_wheel_lock);
+    if (timer->pending) {
+        timer_wheel_unlink(timer);
+    }
+
+    timer->expires = timer_wheel_now - 1 + timer_ms_to_ticks(ms);
+    timer_wheel_insert(timer);
+    timer->pending = true;
+    spin_unlock_irqrestore(&timer_wheel_lock, flags);
+
+    // The bootstrap processor may sleep past this timer with its tick off.
+    cpu_wakeup(cpu_get(0));
+}
+
+
+/**
+ * @brief Stop a pending timer.
+ *
+ * @param timer
+ * @return true the timer was pending and will not run
+ * @return false the timer already ran, or is running
+ */
+bool timer_cancel(struct timer* timer) {
+    uint32_t flags   = spin_lock_irqsave(&timer_wheel_lock);
+    bool     pending = timer->pending;
+    if (pending) {
+        timer_wheel_unlink(timer);
+    }
+    spin_unlock_irqrestore(&timer_wheel_lock, flags);
+
+    return pending;
+}
+
+
+bool timer_pending(struct timer* timer) {
+    return timer->pending;
+}
+
+
+/**
+ * @brief Ticks from the current tick until the wheel needs to run again.
+ *        Exact for timers on level 0, for a higher level it is the start of
+ *        the next non empty slot, where its timers cascade down.
+ *
+ * @param ticks_out
+ * @return true when a timer is pending
+ */
+bool timer_wheel_next_expiry(uint32_t* ticks_out) {
+    uint32_t flags = spin_lock_irqsave(&timer_wheel_lock);
+    bool     found = false;
+    uint32_t next  = 0;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        int      shift = TIMER_WHEEL_BITS * level;
+        uint32_t base  = timer_wheel_now >> shift;
+        // Level 0 starts at the current slot. A higher level starts at the
+        // next one, unless the current one did not cascade down yet.
+        int first = (level == 0 || (timer_wheel_now & ((1u << shift) - 1)) == 0) ? 0 : 1;
+        for (int i = first; i <= TIMER_WHEEL_SLOTS; ++i) {
+            if (!timer_wheel[level][(base + i) & TIMER_WHEEL_MASK]) {
+                continue;
+            }
+
+            uint32_t expires = (base + i) << shift;
+            if (!found || (int32_t)(expires - next) < 0) {
+                next = expires;
+            }
+            found = true;
+            break;
+        }
+    }
+
+    // timer_wheel_now is one past the current tick.
+    *ticks_out = found ? next - (timer_wheel_now - 1) : 0;
+    spin_unlock_irqrestore(&timer_wheel_lock, flags);
+
+    return found;
+}
+
+
+/**
+ * @brief Expire every timer due up to tick now, called from the tick of the
+ *        bootstrap processor. Callbacks run without the wheel lock, so they
+ *        may add or cancel timers.
+ *
+ * @param now current tick
+ */
+void timer_wheel_run(uint32_t now) {
+    uint32_t flags = spin_lock_irqsave(&timer_wheel_lock);
+    while ((int32_t)(now - timer_wheel_now) >= 0) {
+        int slot = timer_wheel_now & TIMER_WHEEL_MASK;
+
+        // Start of a new round of the lower level, pull the next slot down.
+        for (int level = 1; slot == 0 && level < TIMER_WHEEL_LEVELS; ++level) {
+            slot = timer_wheel_cascade(
+                level, (timer_wheel_now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+        }
+
+        // Detach the slot and count the tick before any callback runs: a
+        // timer re-added from a callback lands in a later tick, never back
+        // in the list being run. timer_cancel() unlinks from the local list.
+        struct timer** head = &timer_wheel[0][timer_wheel_now & TIMER_WHEEL_MASK];
+        struct timer*  list = *head;
+        *head               = 0;
+        if (list) {
+            list->pprev = &list;
+        }
+        timer_wheel_now++;
+
+        while (list) {
+            struct timer*           timer    = list;
+            TIMER_CALLBACK_FUNCTION function = timer->function;
+            void*                   data     = timer->data;
+            timer_wheel_unlink(timer);
+
+            spin_unlock(&timer_wheel_lock);
+            function(data);
+            spin_lock(&timer_wheel_lock);
+        }
+    }
+    spin_unlock_irqrestore(&timer_wheel_lock, flags);
+}
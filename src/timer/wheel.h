@@ -0,0 +1,41 @@
+#ifndef _WHEEL_H
+#define _WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel, TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS
+// slots, a slot of level n spans TIMER_WHEEL_SLOTS^n ticks. Insert and cancel
+// are O(1), a timer is moved down one level when its slot comes round.
+#define TIMER_WHEEL_BITS   6
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK   (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+// Longer timeouts are clamped, about 46 hours at 100Hz.
+#define TIMER_WHEEL_MAX_TICKS ((1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+typedef void (*TIMER_CALLBACK_FUNCTION)(void* data);
+
+// Owned by the caller, often embedded in the structure that waits.
+struct timer {
+    uint32_t                expires;  // tick, see timer_ticks()
+    TIMER_CALLBACK_FUNCTION function;
+    void*                   data;
+
+    // Slot list, pprev points at the previous next field (or the slot head)
+    // so a timer unlinks itself without walking the slot.
+    struct timer*  next;
+    struct timer** pprev;
+    bool           pending;
+};
+
+void timer_setup(struct timer* timer, TIMER_CALLBACK_FUNCTION function,
+                 void* data);
+void timer_add(struct timer* timer, uint32_t ms);
+bool timer_cancel(struct timer* timer);
+bool timer_pending(struct timer* timer);
+
+void timer_wheel_run(uint32_t now);
+bool timer_wheel_next_expiry(uint32_t* ticks_out);
+
+#endif